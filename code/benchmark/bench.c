@@ -0,0 +1,497 @@
+/*
+ * Workload benchmark for a mounted TFS. Every workload runs in its own
+ * scratch directory under the mount point and records the latency of each
+ * system call it times; results (throughput plus latency percentiles) are
+ * printed as JSON to stdout or to the -o file, progress goes to stderr.
+ *
+ *	usage: bench [-d mountdir] [-o out.json] [-w seq,rand,meta,mt]
+ *	             [-f file_mb] [-r rand_ops] [-n files] [-D depth] [-t threads]
+ *
+ * The mount point is -d, else $TFS_MOUNT, else TESTDIR.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifndef TESTDIR
+#define TESTDIR "/tmp/njs184/mountdir"
+#endif
+
+#define FSPATHLEN 256
+#define FILEPERM 0666
+#define DIRPERM 0755
+#define MAX_IO_SIZE (256*1024)
+#define MAX_RESULTS 64
+
+static const int io_sizes[] = { 4096, 16384, 65536, 262144 };
+#define N_IO_SIZES ((int)(sizeof(io_sizes)/sizeof(io_sizes[0])))
+
+static const char *mount_dir = TESTDIR;
+static char work_dir[FSPATHLEN];
+static long file_mb = 8;
+static long rand_ops = 2048;
+static long n_files = 500;
+static long tree_depth = 16;
+static long n_threads = 4;
+
+/* latency samples of one measurement, in ns */
+struct lat {
+	uint64_t	*ns;
+	size_t		n, cap;
+};
+
+struct result {
+	char		name[32];
+	int			io_size;			/* 0 for metadata workloads */
+	int			threads;
+	uint64_t	ops;
+	uint64_t	bytes;
+	uint64_t	elapsed_ns;
+	struct lat	lat;
+};
+
+static struct result results[MAX_RESULTS];
+static int n_results = 0;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void lat_add(struct lat *l, uint64_t ns) {
+	if (l->n == l->cap) {
+		l->cap = l->cap ? l->cap*2 : 1024;
+		l->ns = realloc(l->ns, sizeof(uint64_t)*l->cap);
+		if (l->ns == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	l->ns[l->n++] = ns;
+}
+
+static void die(const char *what, const char *path) {
+	fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+static struct result *result_new(const char *name, int io_size, int threads) {
+	if (n_results == MAX_RESULTS) {
+		fprintf(stderr, "too many results\n");
+		exit(1);
+	}
+	struct result *r = &results[n_results++];
+	memset(r, 0, sizeof(*r));
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->io_size = io_size;
+	r->threads = threads;
+	return r;
+}
+
+//xorshift64, one state per thread
+static uint64_t next_rand(uint64_t *s) {
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static void fill(char *buf, size_t len, int seed) {
+	size_t i;
+	for (i = 0; i < len; i++) {
+		buf[i] = 'a' + (i+seed) % 26;
+	}
+}
+
+/*
+ * seq: write a file_mb file front to back with each I/O size (fsync
+ * included in the elapsed time), then read it back the same way.
+ */
+static void bench_seq() {
+	char path[2*FSPATHLEN];
+	char *buf = malloc(MAX_IO_SIZE);
+	int i;
+	fill(buf, MAX_IO_SIZE, 0);
+	for (i = 0; i < N_IO_SIZES; i++) {
+		int sz = io_sizes[i];
+		long n = file_mb*1024*1024/sz, k;
+		snprintf(path, sizeof(path), "%s/seq%d", work_dir, sz);
+
+		struct result *w = result_new("seq_write", sz, 1);
+		uint64_t start = now_ns();
+		int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, FILEPERM);
+		if (fd < 0) {
+			die("open", path);
+		}
+		for (k = 0; k < n; k++) {
+			uint64_t t = now_ns();
+			if (write(fd, buf, sz) != sz) {
+				die("write", path);
+			}
+			lat_add(&w->lat, now_ns()-t);
+		}
+		if (fsync(fd) < 0 || close(fd) < 0) {
+			die("fsync", path);
+		}
+		w->elapsed_ns = now_ns()-start;
+		w->ops = n;
+		w->bytes = (uint64_t)n*sz;
+
+		struct result *r = result_new("seq_read", sz, 1);
+		start = now_ns();
+		if ((fd = open(path, O_RDONLY)) < 0) {
+			die("open", path);
+		}
+		for (k = 0; k < n; k++) {
+			uint64_t t = now_ns();
+			if (read(fd, buf, sz) != sz) {
+				die("read", path);
+			}
+			lat_add(&r->lat, now_ns()-t);
+		}
+		close(fd);
+		r->elapsed_ns = now_ns()-start;
+		r->ops = n;
+		r->bytes = (uint64_t)n*sz;
+		unlink(path);
+		fprintf(stderr, "seq %d done\n", sz);
+	}
+	free(buf);
+}
+
+/*
+ * rand: rand_ops aligned pwrites then preads at random offsets of a
+ * preallocated file_mb file, for each I/O size.
+ */
+static void bench_rand() {
+	char path[2*FSPATHLEN];
+	char *buf = malloc(MAX_IO_SIZE);
+	uint64_t seed = 0x9E3779B97F4A7C15ULL;
+	long size = file_mb*1024*1024, k;
+	int i, fd;
+	fill(buf, MAX_IO_SIZE, 1);
+	snprintf(path, sizeof(path), "%s/rand", work_dir);
+	if ((fd = open(path, O_CREAT | O_TRUNC | O_RDWR, FILEPERM)) < 0) {
+		die("open", path);
+	}
+	for (k = 0; k < size; k += MAX_IO_SIZE) {
+		if (write(fd, buf, MAX_IO_SIZE) != MAX_IO_SIZE) {
+			die("write", path);
+		}
+	}
+	fsync(fd);
+	for (i = 0; i < N_IO_SIZES; i++) {
+		int sz = io_sizes[i];
+		long slots = size/sz;
+		struct result *w = result_new("rand_write", sz, 1);
+		uint64_t start = now_ns();
+		for (k = 0; k < rand_ops; k++) {
+			off_t off = (off_t)(next_rand(&seed) % slots)*sz;
+			uint64_t t = now_ns();
+			if (pwrite(fd, buf, sz, off) != sz) {
+				die("pwrite", path);
+			}
+			lat_add(&w->lat, now_ns()-t);
+		}
+		fsync(fd);
+		w->elapsed_ns = now_ns()-start;
+		w->ops = rand_ops;
+		w->bytes = (uint64_t)rand_ops*sz;
+
+		struct result *r = result_new("rand_read", sz, 1);
+		start = now_ns();
+		for (k = 0; k < rand_ops; k++) {
+			off_t off = (off_t)(next_rand(&seed) % slots)*sz;
+			uint64_t t = now_ns();
+			if (pread(fd, buf, sz, off) != sz) {
+				die("pread", path);
+			}
+			lat_add(&r->lat, now_ns()-t);
+		}
+		r->elapsed_ns = now_ns()-start;
+		r->ops = rand_ops;
+		r->bytes = (uint64_t)rand_ops*sz;
+		fprintf(stderr, "rand %d done\n", sz);
+	}
+	close(fd);
+	unlink(path);
+	free(buf);
+}
+
+//Time one metadata call into r
+#define TIMED_CALL(r, call, what, path) do { \
+	uint64_t t_ = now_ns(); \
+	if ((call) < 0) { \
+		die(what, path); \
+	} \
+	lat_add(&(r)->lat, now_ns()-t_); \
+	(r)->ops++; \
+} while (0)
+
+/*
+ * meta: create, stat and unlink n_files files, first all in one directory
+ * (wide) and then spread over a chain of tree_depth nested directories
+ * (deep, where every lookup walks the whole path).
+ */
+static void bench_meta() {
+	char path[3*FSPATHLEN], dir[2*FSPATHLEN];
+	struct stat st;
+	long i, d;
+	int fd;
+
+	// wide: one directory
+	struct result *c = result_new("wide_create", 0, 1);
+	struct result *s = result_new("wide_stat", 0, 1);
+	struct result *u = result_new("wide_unlink", 0, 1);
+	snprintf(dir, sizeof(dir), "%s/wide", work_dir);
+	if (mkdir(dir, DIRPERM) < 0) {
+		die("mkdir", dir);
+	}
+	uint64_t start = now_ns();
+	for (i = 0; i < n_files; i++) {
+		snprintf(path, sizeof(path), "%s/f%ld", dir, i);
+		TIMED_CALL(c, fd = creat(path, FILEPERM), "creat", path);
+		close(fd);
+	}
+	c->elapsed_ns = now_ns()-start;
+	start = now_ns();
+	for (i = 0; i < n_files; i++) {
+		snprintf(path, sizeof(path), "%s/f%ld", dir, (i*7919) % n_files);
+		TIMED_CALL(s, stat(path, &st), "stat", path);
+	}
+	s->elapsed_ns = now_ns()-start;
+	start = now_ns();
+	for (i = 0; i < n_files; i++) {
+		snprintf(path, sizeof(path), "%s/f%ld", dir, i);
+		TIMED_CALL(u, unlink(path), "unlink", path);
+	}
+	u->elapsed_ns = now_ns()-start;
+	rmdir(dir);
+	fprintf(stderr, "wide done\n");
+
+	// deep: files spread over every level of a directory chain
+	c = result_new("deep_create", 0, 1);
+	s = result_new("deep_stat", 0, 1);
+	u = result_new("deep_unlink", 0, 1);
+	char **dirs = malloc(sizeof(char*)*tree_depth);
+	snprintf(dir, sizeof(dir), "%s", work_dir);
+	for (d = 0; d < tree_depth; d++) {
+		if (strlen(dir)+4 >= FSPATHLEN) {
+			tree_depth = d;
+			break;
+		}
+		strcat(dir, "/d");
+		dirs[d] = strdup(dir);
+	}
+	start = now_ns();
+	for (d = 0; d < tree_depth; d++) {
+		TIMED_CALL(c, mkdir(dirs[d], DIRPERM), "mkdir", dirs[d]);
+	}
+	for (i = 0; i < n_files; i++) {
+		snprintf(path, sizeof(path), "%s/f%ld", dirs[i % tree_depth], i);
+		TIMED_CALL(c, fd = creat(path, FILEPERM), "creat", path);
+		close(fd);
+	}
+	c->elapsed_ns = now_ns()-start;
+	start = now_ns();
+	for (i = 0; i < n_files; i++) {
+		long j = (i*7919) % n_files;
+		snprintf(path, sizeof(path), "%s/f%ld", dirs[j % tree_depth], j);
+		TIMED_CALL(s, stat(path, &st), "stat", path);
+	}
+	s->elapsed_ns = now_ns()-start;
+	start = now_ns();
+	for (i = 0; i < n_files; i++) {
+		snprintf(path, sizeof(path), "%s/f%ld", dirs[i % tree_depth], i);
+		TIMED_CALL(u, unlink(path), "unlink", path);
+	}
+	for (d = tree_depth-1; d >= 0; d--) {
+		TIMED_CALL(u, rmdir(dirs[d]), "rmdir", dirs[d]);
+		free(dirs[d]);
+	}
+	u->elapsed_ns = now_ns()-start;
+	free(dirs);
+	fprintf(stderr, "deep done\n");
+}
+
+/*
+ * mt: n_threads threads, each on its own 1MB file, doing rand_ops
+ * operations: 60% 4K preads, 30% 4K pwrites, 10% stats.
+ */
+struct mt_arg {
+	int			id;
+	struct lat	lat;
+	uint64_t	bytes;
+};
+
+static void *mt_worker(void *p) {
+	struct mt_arg *a = p;
+	char path[2*FSPATHLEN], buf[4096];
+	struct stat st;
+	uint64_t seed = 0x2545F4914F6CDD1DULL * (a->id+1);
+	long k, slots = 256;
+	int fd;
+	fill(buf, sizeof(buf), a->id);
+	snprintf(path, sizeof(path), "%s/mt%d", work_dir, a->id);
+	if ((fd = open(path, O_CREAT | O_TRUNC | O_RDWR, FILEPERM)) < 0) {
+		die("open", path);
+	}
+	for (k = 0; k < slots; k++) {
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+			die("write", path);
+		}
+	}
+	for (k = 0; k < rand_ops; k++) {
+		uint64_t r = next_rand(&seed);
+		off_t off = (off_t)((r >> 8) % slots)*sizeof(buf);
+		uint64_t t = now_ns();
+		if (r % 10 < 6) {
+			if (pread(fd, buf, sizeof(buf), off) != sizeof(buf)) {
+				die("pread", path);
+			}
+			a->bytes += sizeof(buf);
+		} else if (r % 10 < 9) {
+			if (pwrite(fd, buf, sizeof(buf), off) != sizeof(buf)) {
+				die("pwrite", path);
+			}
+			a->bytes += sizeof(buf);
+		} else if (stat(path, &st) < 0) {
+			die("stat", path);
+		}
+		lat_add(&a->lat, now_ns()-t);
+	}
+	close(fd);
+	unlink(path);
+	return NULL;
+}
+
+static void bench_mt() {
+	pthread_t *tids = malloc(sizeof(pthread_t)*n_threads);
+	struct mt_arg *args = calloc(n_threads, sizeof(struct mt_arg));
+	struct result *r = result_new("mt_mixed", 4096, n_threads);
+	long i;
+	size_t k;
+	uint64_t start = now_ns();
+	for (i = 0; i < n_threads; i++) {
+		args[i].id = i;
+		pthread_create(&tids[i], NULL, mt_worker, &args[i]);
+	}
+	for (i = 0; i < n_threads; i++) {
+		pthread_join(tids[i], NULL);
+		for (k = 0; k < args[i].lat.n; k++) {
+			lat_add(&r->lat, args[i].lat.ns[k]);
+		}
+		r->bytes += args[i].bytes;
+		free(args[i].lat.ns);
+	}
+	r->elapsed_ns = now_ns()-start;
+	r->ops = r->lat.n;
+	free(args);
+	free(tids);
+	fprintf(stderr, "mt done\n");
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double pct_us(struct lat *l, double p) {
+	if (l->n == 0) {
+		return 0;
+	}
+	size_t i = (size_t)(p*(l->n-1));
+	return l->ns[i]/1000.0;
+}
+
+static void print_json(FILE *f) {
+	int i;
+	fprintf(f, "{\n  \"mount\": \"%s\",\n  \"time\": %ld,\n  \"results\": [\n", mount_dir, (long)time(NULL));
+	for (i = 0; i < n_results; i++) {
+		struct result *r = &results[i];
+		double secs = r->elapsed_ns/1e9;
+		uint64_t sum = 0;
+		size_t k;
+		qsort(r->lat.ns, r->lat.n, sizeof(uint64_t), cmp_u64);
+		for (k = 0; k < r->lat.n; k++) {
+			sum += r->lat.ns[k];
+		}
+		fprintf(f, "    {\"name\": \"%s\", \"io_size\": %d, \"threads\": %d, \"ops\": %llu, \"bytes\": %llu, "
+			"\"seconds\": %.6f, \"ops_per_s\": %.1f, \"mb_per_s\": %.2f, "
+			"\"lat_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}%s\n",
+			r->name, r->io_size, r->threads, (unsigned long long)r->ops, (unsigned long long)r->bytes,
+			secs, secs > 0 ? r->ops/secs : 0, secs > 0 ? r->bytes/secs/(1024*1024) : 0,
+			r->lat.n ? sum/1000.0/r->lat.n : 0, pct_us(&r->lat, 0.5), pct_us(&r->lat, 0.9),
+			pct_us(&r->lat, 0.99), pct_us(&r->lat, 0.999), pct_us(&r->lat, 1.0),
+			i+1 < n_results ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-d mountdir] [-o out.json] [-w seq,rand,meta,mt]\n"
+		"          [-f file_mb] [-r rand_ops] [-n files] [-D depth] [-t threads]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	const char *out = NULL, *workloads = "seq,rand,meta,mt";
+	int opt;
+	if (getenv("TFS_MOUNT") != NULL) {
+		mount_dir = getenv("TFS_MOUNT");
+	}
+	while ((opt = getopt(argc, argv, "d:o:w:f:r:n:D:t:")) != -1) {
+		switch (opt) {
+		case 'd': mount_dir = optarg; break;
+		case 'o': out = optarg; break;
+		case 'w': workloads = optarg; break;
+		case 'f': file_mb = atol(optarg); break;
+		case 'r': rand_ops = atol(optarg); break;
+		case 'n': n_files = atol(optarg); break;
+		case 'D': tree_depth = atol(optarg); break;
+		case 't': n_threads = atol(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (file_mb < 1 || rand_ops < 1 || n_files < 1 || tree_depth < 1 || n_threads < 1) {
+		usage(argv[0]);
+	}
+
+	snprintf(work_dir, sizeof(work_dir), "%s/bench.%d", mount_dir, (int)getpid());
+	if (mkdir(work_dir, DIRPERM) < 0) {
+		die("mkdir", work_dir);
+	}
+	if (strstr(workloads, "seq")) {
+		bench_seq();
+	}
+	if (strstr(workloads, "rand")) {
+		bench_rand();
+	}
+	if (strstr(workloads, "meta")) {
+		bench_meta();
+	}
+	if (strstr(workloads, "mt")) {
+		bench_mt();
+	}
+	rmdir(work_dir);
+
+	FILE *f = stdout;
+	if (out != NULL && (f = fopen(out, "w")) == NULL) {
+		die("fopen", out);
+	}
+	print_json(f);
+	if (f != stdout) {
+		fclose(f);
+	}
+	return 0;
+}
@@ -8,8 +8,10 @@
 #include <sys/types.h>
 #include <dirent.h>
 
-/* You need to change this macro to your TFS mount point*/
+/* You need to change this macro to your TFS mount point (or build with make MOUNT=dir)*/
+#ifndef TESTDIR
 #define TESTDIR "/tmp/njs184/mountdir"
+#endif
 
 #define N_FILES 100
 #define BLOCKSIZE 4096
@@ -8,14 +8,17 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <time.h>
-/* You need to change this macro to your TFS mount point*/
+/* You need to change this macro to your TFS mount point (or build with make MOUNT=dir)*/
+#ifndef TESTDIR
 #define TESTDIR "/tmp/njs184/mountdir"
+#endif
 
 #define N_FILES 100
 #define BLOCKSIZE 4096
 #define FSPATHLEN 256
 #define ITERS 16
 #define ITERS_LARGE 2048
+#define FRAG_BLOCKS 2048
 #define FILEPERM 0666
 #define DIRPERM 0755
 
@@ -215,6 +218,39 @@ int main(int argc, char **argv) {
 	close(fd);	
 
 	*/
+
+
+	/* TEST 11: fragmented file test. Only every other block is written,
+	 * so no two blocks can share an extent, like a file written into
+	 * fragmented free space */
+	if ((fd = open(TESTDIR "/fragfile", O_CREAT | O_RDWR, FILEPERM)) < 0) {
+		perror("open");
+		printf("TEST 11: Fragmented file write failure \n");
+		exit(1);
+	}
+	for (i = 0; i < FRAG_BLOCKS; i++) {
+		memset(buf, 0x61 + i % 26, BLOCKSIZE);
+		if (pwrite(fd, buf, BLOCKSIZE, (off_t)2*i*BLOCKSIZE) != BLOCKSIZE) {
+			perror("pwrite");
+			printf("TEST 11: Fragmented file write failure \n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < FRAG_BLOCKS; i++) {
+		if (pread(fd, buf, BLOCKSIZE, (off_t)2*i*BLOCKSIZE) != BLOCKSIZE || buf[0] != 0x61 + i % 26
+				|| buf[BLOCKSIZE-1] != 0x61 + i % 26) {
+			printf("TEST 11: Fragmented file read failure \n");
+			exit(1);
+		}
+	}
+	close(fd);
+	if (unlink(TESTDIR "/fragfile") < 0) {
+		perror("unlink");
+		printf("TEST 11: Fragmented file unlink failure \n");
+		exit(1);
+	}
+	printf("TEST 11: Fragmented file write-read success \n");
+
 	printf("Benchmark completed \n");
 	return 0;
 }
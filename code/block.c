@@ -1,40 +1,494 @@
 /*
  *  Copyright (C) 2021 CS416 Rutgers CS
- *	
+ *
  *	Tiny File System
  *
  *	File:	block.c
  *
  */
 
+#define _GNU_SOURCE		/* sync_file_range() */
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+//linux/fs.h (pulled in by io_uring.h) has its own BLOCK_SIZE
+#undef BLOCK_SIZE
 
 #include "block.h"
-
-//Disk size set to 32MB
-#define DISK_SIZE	32*1024*1024
+#include "stats.h"
+#include "trace.h"
 
 int diskfile = -1;
 
-//Creates a file which is your new emulated disk
-void dev_init(const char* diskfile_path) {
+//Most blocks handed to a single preadv/pwritev
+#define IOV_BATCH 256
+
+/*
+ * io_uring backend for the vectored paths (bio_readv, bio_writev and the
+ * write-back in bio_flush): every run of consecutive blocks becomes one
+ * READV/WRITEV SQE, queued in batches of up to the queue depth and
+ * submitted with a single io_uring_enter. Completions are waited for in
+ * io_uring_enter, or spun on in the CQ ring when polling is on. Callers
+ * share the ring under ring_lock. Single-block bio_read/bio_write stay on
+ * pread/pwrite.
+ */
+struct uring {
+	int fd;
+	unsigned entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	char *sq_ring, *cq_ring;
+	size_t sq_ring_len, cq_ring_len, sqes_len;
+};
+
+static struct uring ring = { .fd = -1 };
+static int uring_depth = 0;
+static int uring_poll = 0;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * A run of physically consecutive blocks for the vectored paths: nvec
+ * BLOCK_SIZE buffers in iov starting at block_num, and the byte count (or
+ * -errno) the I/O returned.
+ */
+struct bio_run {
+	int block_num;
+	int nvec;
+	struct iovec *iov;
+	ssize_t res;
+};
+
+/*
+ * mmap backend: when enabled the whole disk file is mapped at open time
+ * and block I/O is a memcpy to or from the mapping. bio_flush() msyncs it.
+ */
+static int use_mmap = 0;
+static char *disk_map = NULL;
+static size_t disk_map_len = 0;
+
+/*
+ * Write-back block cache. Blocks are found through a hash table keyed by
+ * block number and kept on a circular LRU list (most recently used at the
+ * front). Dirty blocks only reach the disk file when they are evicted or
+ * when bio_flush() is called.
+ */
+struct cache_blk {
+	int block_num;
+	int dirty;
+	int pinned;							/* handed out by bio_take_dirty(), not written home yet */
+	struct cache_blk *hnext;			/* next block in the same hash bucket */
+	struct cache_blk *prev, *next;		/* LRU list */
+	char data[BLOCK_SIZE];
+};
+
+static int cache_size = BLOCK_CACHE_SIZE;
+static int cache_used = 0;
+static int cache_nbuckets = 0;
+static struct cache_blk *cache_blocks = NULL;
+static struct cache_blk **cache_hash = NULL;
+static struct cache_blk cache_lru;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int cache_no_steal = 0;			/* journal mode, see bio_journal_config() */
+static int cache_dirty = 0;				/* dirty blocks, changed under cache_lock only */
+static int cache_pinned = 0;			/* pinned blocks */
+static pthread_cond_t cache_unpinned = PTHREAD_COND_INITIALIZER;
+
+//Read count blocks from the mapping, zero-filling anything past its end
+static ssize_t map_read(int block_num, int count, void *buf) {
+	size_t off = (size_t)block_num*BLOCK_SIZE, len = (size_t)count*BLOCK_SIZE;
+	size_t n = off >= disk_map_len ? 0 : (disk_map_len-off < len ? disk_map_len-off : len);
+	memcpy(buf, disk_map+off, n);
+	memset((char*)buf+n, 0, len-n);
+	return n;
+}
+
+static ssize_t map_write(int block_num, int count, const void *buf) {
+	size_t off = (size_t)block_num*BLOCK_SIZE, len = (size_t)count*BLOCK_SIZE;
+	if (block_num < 0 || off+len > disk_map_len) {
+		fprintf(stderr, "block_write failed: block %d past end of disk\n", block_num+count-1);
+		return -1;
+	}
+	memcpy(disk_map+off, buf, len);
+	return len;
+}
+
+static int disk_read(int block_num, void *buf) {
+	if (disk_map != NULL) {
+		return map_read(block_num, 1, buf);
+	}
+	stat_count(SC_SYSCALLS, 1);
+	int retstat = pread(diskfile, buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+	if (retstat <= 0) {
+		memset (buf, 0, BLOCK_SIZE);
+		if (retstat < 0) {
+			perror("block_read failed");
+			TRACE(TRACE_ERROR, TR_IO_ERROR, block_num, 0, errno);
+		}
+	}
+	return retstat;
+}
+
+static int disk_write(int block_num, const void *buf) {
+	if (disk_map != NULL) {
+		return map_write(block_num, 1, buf);
+	}
+	stat_count(SC_SYSCALLS, 1);
+	int retstat = pwrite(diskfile, buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+	if (retstat < 0) {
+		perror("block_write failed");
+		TRACE(TRACE_ERROR, TR_IO_ERROR, block_num, 1, errno);
+	}
+	return retstat;
+}
+
+static void map_init() {
+	struct stat st;
+	if (!use_mmap || fstat(diskfile, &st) < 0 || st.st_size == 0) {
+		return;
+	}
+	void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, diskfile, 0);
+	if (p == MAP_FAILED) {
+		//fall back to pread/pwrite
+		perror("disk mmap failed");
+		return;
+	}
+	disk_map = p;
+	disk_map_len = st.st_size;
+}
+
+static int map_sync() {
+	if (disk_map == NULL) {
+		return 0;
+	}
+	stat_count(SC_SYSCALLS, 1);
+	if (msync(disk_map, disk_map_len, MS_SYNC) < 0) {
+		perror("msync failed");
+		return -1;
+	}
+	return 0;
+}
+
+static void map_free() {
+	if (disk_map != NULL) {
+		map_sync();
+		munmap(disk_map, disk_map_len);
+		disk_map = NULL;
+		disk_map_len = 0;
+	}
+}
+
+static void ring_free() {
+	if (ring.fd < 0) {
+		return;
+	}
+	munmap(ring.sqes, ring.sqes_len);
+	if (ring.cq_ring != ring.sq_ring) {
+		munmap(ring.cq_ring, ring.cq_ring_len);
+	}
+	munmap(ring.sq_ring, ring.sq_ring_len);
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+static void ring_init() {
+	struct io_uring_params p;
+	if (uring_depth <= 0 || disk_map != NULL || ring.fd >= 0) {
+		return;
+	}
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, uring_depth, &p);
+	if (fd < 0) {
+		//fall back to preadv/pwritev
+		perror("io_uring_setup failed");
+		return;
+	}
+	ring.fd = fd;
+	ring.entries = p.sq_entries;
+	ring.sq_ring_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	ring.cq_ring_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_ring_len > ring.sq_ring_len) {
+			ring.sq_ring_len = ring.cq_ring_len;
+		}
+		ring.cq_ring_len = ring.sq_ring_len;
+	}
+	ring.sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+	ring.sq_ring = mmap(NULL, ring.sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	ring.cq_ring = ring.sq_ring;
+	if (ring.sq_ring != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		ring.cq_ring = mmap(NULL, ring.cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	}
+	ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring.sq_ring == MAP_FAILED || ring.cq_ring == MAP_FAILED || ring.sqes == MAP_FAILED) {
+		perror("io_uring mmap failed");
+		if (ring.sqes != MAP_FAILED) {
+			munmap(ring.sqes, ring.sqes_len);
+		}
+		if (ring.cq_ring != MAP_FAILED && ring.cq_ring != ring.sq_ring) {
+			munmap(ring.cq_ring, ring.cq_ring_len);
+		}
+		if (ring.sq_ring != MAP_FAILED) {
+			munmap(ring.sq_ring, ring.sq_ring_len);
+		}
+		close(fd);
+		ring.fd = -1;
+		return;
+	}
+	ring.sq_head = (unsigned*)(ring.sq_ring + p.sq_off.head);
+	ring.sq_tail = (unsigned*)(ring.sq_ring + p.sq_off.tail);
+	ring.sq_mask = (unsigned*)(ring.sq_ring + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned*)(ring.sq_ring + p.sq_off.array);
+	ring.cq_head = (unsigned*)(ring.cq_ring + p.cq_off.head);
+	ring.cq_tail = (unsigned*)(ring.cq_ring + p.cq_off.tail);
+	ring.cq_mask = (unsigned*)(ring.cq_ring + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe*)(ring.cq_ring + p.cq_off.cqes);
+}
+
+/*
+ * Run every bio_run through the ring, keeping up to the queue depth in
+ * flight. Each round queues as many SQEs as there is room for, submits them
+ * with one io_uring_enter and reaps whatever has completed. If
+ * io_uring_enter fails for good, the requests already in the kernel are
+ * waited out, the ring is shut down and -1 tells the caller to do the
+ * whole batch again with preadv/pwritev (redoing the runs that did
+ * complete is harmless, they read or write the same buffers).
+ */
+static int ring_runs(struct bio_run *runs, int nruns, int write) {
+	int next = 0, done = 0, failed = 0;
+	unsigned inflight = 0, unsubmitted = 0;
+	pthread_mutex_lock(&ring_lock);
+	//another thread may have given up on the ring since the caller looked
+	if (ring.fd < 0) {
+		pthread_mutex_unlock(&ring_lock);
+		return -1;
+	}
+	while (done < nruns && !failed) {
+		unsigned tail = *ring.sq_tail;
+		while (next < nruns && inflight < ring.entries) {
+			unsigned idx = tail & *ring.sq_mask;
+			struct io_uring_sqe *sqe = &ring.sqes[idx];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd = diskfile;
+			sqe->off = (off_t)runs[next].block_num*BLOCK_SIZE;
+			sqe->addr = (unsigned long)runs[next].iov;
+			sqe->len = runs[next].nvec;
+			sqe->user_data = next;
+			ring.sq_array[idx] = idx;
+			tail++;
+			next++;
+			inflight++;
+			unsubmitted++;
+		}
+		__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+		unsigned wait = uring_poll ? 0 : 1;
+		if (unsubmitted > 0 || wait) {
+			stat_count(SC_SYSCALLS, 1);
+			int ret = syscall(__NR_io_uring_enter, ring.fd, unsubmitted, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+			if (ret >= 0) {
+				unsubmitted -= ret;
+			} else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				perror("io_uring_enter failed, going back to preadv/pwritev");
+				//take back what the kernel never saw
+				__atomic_store_n(ring.sq_tail, tail-unsubmitted, __ATOMIC_RELEASE);
+				inflight -= unsubmitted;
+				failed = 1;
+			}
+		}
+
+		unsigned head = *ring.cq_head;
+		while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			runs[cqe->user_data].res = cqe->res;
+			head++;
+			done++;
+			inflight--;
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+	if (failed) {
+		//the submitted requests still point at the caller's buffers
+		while (inflight > 0) {
+			unsigned head = *ring.cq_head;
+			while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+				head++;
+				inflight--;
+			}
+			__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+			sched_yield();
+		}
+		ring_free();
+	}
+	pthread_mutex_unlock(&ring_lock);
+	return failed ? -1 : 0;
+}
+
+static void cache_init() {
+	if (cache_size <= 0 || cache_blocks != NULL) {
+		return;
+	}
+	cache_blocks = calloc(cache_size, sizeof(struct cache_blk));
+	//keep the load factor around 1/2
+	cache_nbuckets = 1;
+	while (cache_nbuckets < cache_size*2) {
+		cache_nbuckets <<= 1;
+	}
+	cache_hash = calloc(cache_nbuckets, sizeof(struct cache_blk*));
+	if (cache_blocks == NULL || cache_hash == NULL) {
+		free(cache_blocks);
+		free(cache_hash);
+		cache_blocks = NULL;
+		cache_hash = NULL;
+		cache_size = 0;
+		return;
+	}
+	cache_used = 0;
+	cache_lru.next = cache_lru.prev = &cache_lru;
+}
+
+static void cache_free() {
+	free(cache_blocks);
+	free(cache_hash);
+	cache_blocks = NULL;
+	cache_hash = NULL;
+	cache_used = 0;
+	cache_dirty = 0;
+	cache_pinned = 0;
+}
+
+static inline unsigned cache_bucket(int block_num) {
+	return ((unsigned)block_num * 2654435761u) & (cache_nbuckets - 1);
+}
+
+//Set or clear b's dirty flag, keeping cache_dirty in step
+static void cache_set_dirty(struct cache_blk *b, int dirty) {
+	if (b->dirty != dirty) {
+		__atomic_store_n(&cache_dirty, cache_dirty + (dirty ? 1 : -1), __ATOMIC_RELAXED);
+		b->dirty = dirty;
+	}
+}
+
+static void lru_unlink(struct cache_blk *b) {
+	b->prev->next = b->next;
+	b->next->prev = b->prev;
+}
+
+static void lru_push_front(struct cache_blk *b) {
+	b->next = cache_lru.next;
+	b->prev = &cache_lru;
+	cache_lru.next->prev = b;
+	cache_lru.next = b;
+}
+
+static struct cache_blk *cache_lookup(int block_num) {
+	struct cache_blk *b = cache_hash[cache_bucket(block_num)];
+	while (b != NULL && b->block_num != block_num) {
+		b = b->hnext;
+	}
+	return b;
+}
+
+static void hash_remove(struct cache_blk *b) {
+	struct cache_blk **pp = &cache_hash[cache_bucket(b->block_num)];
+	while (*pp != b) {
+		pp = &(*pp)->hnext;
+	}
+	*pp = b->hnext;
+}
+
+/*
+ * Get a slot for block_num that is not in the cache yet: a never used slot
+ * if there is one left, otherwise the least recently used block (written
+ * back first if it is dirty). In journal mode dirty and pinned blocks are
+ * never evicted; if nothing else is left this returns NULL. The slot is
+ * hashed and at the LRU front.
+ */
+static struct cache_blk *cache_get_slot(int block_num) {
+	struct cache_blk *b;
+	if (cache_used < cache_size) {
+		b = &cache_blocks[cache_used++];
+	} else if (cache_no_steal) {
+		for (b = cache_lru.prev; b != &cache_lru && (b->dirty || b->pinned); b = b->prev);
+		if (b == &cache_lru) {
+			return NULL;
+		}
+		TRACE(TRACE_DEBUG, TR_BIO_EVICT, b->block_num, 0, 0);
+		lru_unlink(b);
+		if (b->block_num >= 0) {
+			hash_remove(b);
+		}
+	} else {
+		b = cache_lru.prev;
+		TRACE(TRACE_DEBUG, TR_BIO_EVICT, b->block_num, b->dirty, 0);
+		if (b->dirty && disk_write(b->block_num, b->data) < 0) {
+			return NULL;
+		}
+		lru_unlink(b);
+		if (b->block_num >= 0) {
+			hash_remove(b);
+		}
+	}
+	b->block_num = block_num;
+	cache_set_dirty(b, 0);
+	unsigned h = cache_bucket(block_num);
+	b->hnext = cache_hash[h];
+	cache_hash[h] = b;
+	lru_push_front(b);
+	return b;
+}
+
+//Empty a slot and put it at the LRU tail so it is reused first
+static void cache_drop(struct cache_blk *b) {
+	hash_remove(b);
+	lru_unlink(b);
+	b->next = &cache_lru;
+	b->prev = cache_lru.prev;
+	cache_lru.prev->next = b;
+	cache_lru.prev = b;
+	b->block_num = -1;
+	cache_set_dirty(b, 0);
+	cache_pinned -= b->pinned;
+	b->pinned = 0;
+}
+
+//Creates a file of size bytes which is your new emulated disk
+void dev_init(const char* diskfile_path, uint64_t size) {
     if (diskfile >= 0) {
 		return;
     }
-    
+
     diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
     if (diskfile < 0) {
 		perror("disk_open failed");
 		exit(EXIT_FAILURE);
     }
-	
-    ftruncate(diskfile, DISK_SIZE);
+
+    struct stat st;
+    //keep a larger existing image, grow anything smaller. The blocks are
+    //allocated up front so overwriting one later never allocates in the host
+    //file system (see bio_sync_blocks); sparse is the fallback.
+    if (fstat(diskfile, &st) < 0 || (uint64_t)st.st_size < size) {
+		if (posix_fallocate(diskfile, 0, size) != 0) {
+			ftruncate(diskfile, size);
+		}
+    }
+    map_init();
+    ring_init();
+    cache_init();
 }
 
 //Function to open the disk file
@@ -42,41 +496,486 @@ int dev_open(const char* diskfile_path) {
     if (diskfile >= 0) {
 		return 0;
     }
-    
+
     diskfile = open(diskfile_path, O_RDWR, S_IRUSR | S_IWUSR);
     if (diskfile < 0) {
 		perror("disk_open failed");
 		return -1;
     }
+    map_init();
+    ring_init();
+    cache_init();
 	return 0;
 }
 
 void dev_close() {
     if (diskfile >= 0) {
+		bio_flush();
+		cache_free();
+		ring_free();
+		map_free();
 		close(diskfile);
+		diskfile = -1;
     }
 }
 
+//Set the number of cached blocks, takes effect on the next dev_init/dev_open
+void bio_cache_config(int nblocks) {
+	pthread_mutex_lock(&cache_lock);
+	if (cache_blocks == NULL) {
+		cache_size = nblocks < 0 ? 0 : nblocks;
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+//Choose the mmap backend (1) or pread/pwrite (0) for the next dev_init/dev_open
+void bio_mmap_config(int enable) {
+	use_mmap = enable;
+}
+
+//Use an io_uring of the given depth for vectored I/O (0 for preadv/pwritev)
+void bio_uring_config(int depth, int poll) {
+	uring_depth = depth;
+	uring_poll = poll;
+}
+
+static int cache_read(const int block_num, void *buf) {
+	if (cache_blocks == NULL) {
+		return disk_read(block_num, buf);
+	}
+	int retstat = BLOCK_SIZE;
+	pthread_mutex_lock(&cache_lock);
+	struct cache_blk *b = cache_lookup(block_num);
+	if (b != NULL) {
+		stat_count(SC_CACHE_HITS, 1);
+		lru_unlink(b);
+		lru_push_front(b);
+	} else {
+		stat_count(SC_CACHE_MISSES, 1);
+		TRACE(TRACE_DEBUG, TR_BIO_MISS, block_num, 0, 0);
+		b = cache_get_slot(block_num);
+		if (b == NULL) {
+			pthread_mutex_unlock(&cache_lock);
+			return disk_read(block_num, buf);
+		}
+		retstat = disk_read(block_num, b->data);
+		if (retstat < 0) {
+			//don't keep a block we failed to read, reuse its slot first
+			cache_drop(b);
+		}
+	}
+	memcpy(buf, b->data, BLOCK_SIZE);
+	pthread_mutex_unlock(&cache_lock);
+	return retstat;
+}
+
 //Read a block from the disk
 int bio_read(const int block_num, void *buf) {
-    int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat <= 0) {
-		memset (buf, 0, BLOCK_SIZE);
-		if (retstat < 0)
-			perror("block_read failed");
-    }
+	uint64_t start = stat_now();
+	int retstat = cache_read(block_num, buf);
+	stat_op(ST_BIO_READ, start, retstat);
+	return retstat;
+}
 
-    return retstat;
+static int cache_write(const int block_num, const void *buf) {
+	if (cache_blocks == NULL) {
+		return disk_write(block_num, buf);
+	}
+	pthread_mutex_lock(&cache_lock);
+	struct cache_blk *b = cache_lookup(block_num);
+	if (b != NULL) {
+		stat_count(SC_CACHE_HITS, 1);
+		lru_unlink(b);
+		lru_push_front(b);
+	} else {
+		stat_count(SC_CACHE_MISSES, 1);
+		//in journal mode the block can't go home, so wait for a commit to unpin some
+		while ((b = cache_get_slot(block_num)) == NULL && cache_no_steal && cache_pinned > 0) {
+			pthread_cond_wait(&cache_unpinned, &cache_lock);
+		}
+		if (b == NULL && cache_no_steal) {
+			//more dirty blocks than txn_begin_credits() lets through: fail the write, the caller's operation fails
+			pthread_mutex_unlock(&cache_lock);
+			fprintf(stderr, "block cache full of uncommitted blocks, block %d not written\n", block_num);
+			TRACE(TRACE_ERROR, TR_IO_ERROR, block_num, 1, ENOSPC);
+			errno = ENOSPC;
+			return -1;
+		}
+		if (b == NULL) {
+			pthread_mutex_unlock(&cache_lock);
+			return disk_write(block_num, buf);
+		}
+	}
+	memcpy(b->data, buf, BLOCK_SIZE);
+	cache_set_dirty(b, 1);
+	pthread_mutex_unlock(&cache_lock);
+	return BLOCK_SIZE;
 }
 
-//Write a block to the disk
+//Write a block to the disk (through the cache, so it may be written back later)
 int bio_write(const int block_num, const void *buf) {
-    int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat < 0) {
-		    perror("block_write failed");
-    }
-    return retstat;
+	uint64_t start = stat_now();
+	int retstat = cache_write(block_num, buf);
+	stat_op(ST_BIO_WRITE, start, retstat);
+	return retstat;
+}
+
+/*
+ * Split block_nums/bufs into runs of consecutive blocks. iov and runs need
+ * room for count entries; returns the number of runs.
+ */
+static int make_runs(const int *block_nums, const void *const *bufs, int count, struct iovec *iov, struct bio_run *runs) {
+	int i, nruns = 0;
+	struct bio_run *r = NULL;
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = (void*)bufs[i];
+		iov[i].iov_len = BLOCK_SIZE;
+		if (r != NULL && block_nums[i] == r->block_num + r->nvec && r->nvec < IOV_BATCH) {
+			r->nvec++;
+		} else {
+			runs[nruns].block_num = block_nums[i];
+			runs[nruns].nvec = 1;
+			runs[nruns].iov = &iov[i];
+			r = &runs[nruns++];
+		}
+	}
+	return nruns;
+}
+
+//Do the I/O for every run on whichever backend is active, -1 if any failed
+static int disk_runs(struct bio_run *runs, int nruns, int write) {
+	int i, j, retstat = 0;
+	if (disk_map != NULL) {
+		for (i = 0; i < nruns; i++) {
+			runs[i].res = 0;
+			for (j = 0; j < runs[i].nvec && runs[i].res >= 0; j++) {
+				ssize_t n = write ? map_write(runs[i].block_num+j, 1, runs[i].iov[j].iov_base)
+					: map_read(runs[i].block_num+j, 1, runs[i].iov[j].iov_base);
+				runs[i].res = n < 0 ? -EIO : runs[i].res+n;
+			}
+		}
+	} else if (ring.fd < 0 || ring_runs(runs, nruns, write) < 0) {
+		stat_count(SC_SYSCALLS, nruns);
+		for (i = 0; i < nruns; i++) {
+			off_t off = (off_t)runs[i].block_num*BLOCK_SIZE;
+			runs[i].res = write ? pwritev(diskfile, runs[i].iov, runs[i].nvec, off)
+				: preadv(diskfile, runs[i].iov, runs[i].nvec, off);
+			if (runs[i].res < 0) {
+				runs[i].res = -errno;
+			}
+		}
+	}
+	for (i = 0; i < nruns; i++) {
+		ssize_t len = (ssize_t)runs[i].nvec*BLOCK_SIZE;
+		if (write && runs[i].res >= 0 && runs[i].res < len) {
+			runs[i].res = -ENOSPC;
+		}
+		if (runs[i].res < 0) {
+			errno = -runs[i].res;
+			perror(write ? "block_write failed" : "block_read failed");
+			TRACE(TRACE_ERROR, TR_IO_ERROR, runs[i].block_num, write, -runs[i].res);
+			retstat = -1;
+		}
+		//anything past the end of the disk file (or unreadable) reads as zeroes
+		for (j = 0; !write && j < runs[i].nvec; j++) {
+			ssize_t got = runs[i].res - (ssize_t)j*BLOCK_SIZE;
+			got = got < 0 ? 0 : (got > BLOCK_SIZE ? BLOCK_SIZE : got);
+			memset((char*)runs[i].iov[j].iov_base+got, 0, BLOCK_SIZE-got);
+		}
+	}
+	return retstat;
+}
+
+/*
+ * Read block_nums[i] into bufs[i] for each i < count. Runs of consecutive
+ * block numbers are read with a single preadv (or one io_uring SQE);
+ * cached copies win over the disk file.
+ */
+int bio_readv(const int *block_nums, void *const *bufs, int count) {
+	uint64_t start = stat_now();
+	int i, retstat = count*BLOCK_SIZE;
+	struct iovec *iov = malloc(sizeof(struct iovec)*count);
+	struct bio_run *runs = malloc(sizeof(struct bio_run)*count);
+	int nruns = make_runs(block_nums, (const void *const *)bufs, count, iov, runs);
+	if (disk_runs(runs, nruns, 0) < 0) {
+		retstat = -1;
+	}
+	free(runs);
+	free(iov);
+	if (cache_blocks != NULL) {
+		pthread_mutex_lock(&cache_lock);
+		for (i = 0; i < count; i++) {
+			struct cache_blk *b = cache_lookup(block_nums[i]);
+			if (b != NULL) {
+				memcpy(bufs[i], b->data, BLOCK_SIZE);
+			}
+		}
+		pthread_mutex_unlock(&cache_lock);
+	}
+	stat_op(ST_BIO_READV, start, retstat);
+	return retstat;
+}
+
+/*
+ * Write bufs[i] to block_nums[i] for each i < count, one pwritev (or SQE)
+ * per run of consecutive block numbers. Cached copies are updated rather
+ * than added.
+ */
+int bio_writev(const int *block_nums, const void *const *bufs, int count) {
+	uint64_t start = stat_now();
+	int i, retstat = count*BLOCK_SIZE;
+	//update cached copies first so a later eviction can't write back stale data
+	if (cache_blocks != NULL) {
+		pthread_mutex_lock(&cache_lock);
+		for (i = 0; i < count; i++) {
+			struct cache_blk *b = cache_lookup(block_nums[i]);
+			if (b != NULL) {
+				memcpy(b->data, bufs[i], BLOCK_SIZE);
+			}
+		}
+		pthread_mutex_unlock(&cache_lock);
+	}
+	struct iovec *iov = malloc(sizeof(struct iovec)*count);
+	struct bio_run *runs = malloc(sizeof(struct bio_run)*count);
+	int nruns = make_runs(block_nums, bufs, count, iov, runs);
+	if (disk_runs(runs, nruns, 1) < 0) {
+		retstat = -1;
+	}
+	free(runs);
+	free(iov);
+	stat_op(ST_BIO_WRITEV, start, retstat);
+	return retstat;
 }
 
+static int cmp_block_num(const void *a, const void *b) {
+	int x = (*(struct cache_blk* const*)a)->block_num;
+	int y = (*(struct cache_blk* const*)b)->block_num;
+	return (x > y) - (x < y);
+}
+
+//Write every dirty cached block back to the disk file, in block order
+int bio_flush() {
+	uint64_t start = stat_now();
+	int i, n = 0, retstat = 0;
+	pthread_mutex_lock(&cache_lock);
+	if (cache_blocks == NULL) {
+		pthread_mutex_unlock(&cache_lock);
+		retstat = map_sync();
+		stat_op(ST_BIO_FLUSH, start, retstat);
+		return retstat;
+	}
+	struct cache_blk **dirty = malloc(sizeof(struct cache_blk*)*(cache_used+1));
+	for (i = 0; i < cache_used; i++) {
+		if (cache_blocks[i].dirty) {
+			dirty[n++] = &cache_blocks[i];
+		}
+	}
+	qsort(dirty, n, sizeof(struct cache_blk*), cmp_block_num);
+	//write adjacent dirty blocks back together
+	int *block_nums = malloc(sizeof(int)*(n+1));
+	const void **bufs = malloc(sizeof(void*)*(n+1));
+	struct iovec *iov = malloc(sizeof(struct iovec)*(n+1));
+	struct bio_run *runs = malloc(sizeof(struct bio_run)*(n+1));
+	for (i = 0; i < n; i++) {
+		block_nums[i] = dirty[i]->block_num;
+		bufs[i] = dirty[i]->data;
+	}
+	int r, nruns = make_runs(block_nums, bufs, n, iov, runs);
+	TRACE(TRACE_DEBUG, TR_BIO_FLUSH, n, nruns, 0);
+	if (disk_runs(runs, nruns, 1) < 0) {
+		retstat = -1;
+	}
+	for (r = 0, i = 0; r < nruns; i += runs[r++].nvec) {
+		if (runs[r].res >= 0) {
+			int j;
+			for (j = 0; j < runs[r].nvec; j++) {
+				cache_set_dirty(dirty[i+j], 0);
+			}
+		}
+	}
+	free(runs);
+	free(iov);
+	free(bufs);
+	free(block_nums);
+	free(dirty);
+	pthread_mutex_unlock(&cache_lock);
+	if (map_sync() < 0) {
+		retstat = -1;
+	}
+	stat_op(ST_BIO_FLUSH, start, retstat);
+	return retstat;
+}
+
+//Turn journal mode (no-steal eviction) on or off
+void bio_journal_config(int enable) {
+	pthread_mutex_lock(&cache_lock);
+	cache_no_steal = enable;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+//Number of cache slots, 0 without a cache
+int bio_cache_blocks() {
+	return cache_blocks != NULL ? cache_size : 0;
+}
+
+//How many cached blocks are dirty, without taking cache_lock
+int bio_dirty_count() {
+	return __atomic_load_n(&cache_dirty, __ATOMIC_RELAXED);
+}
+
+/*
+ * Copy every dirty cached block out, sorted by block number, into
+ * *block_nums and *data (BLOCK_SIZE each, free both), and mark them clean
+ * but pinned. Returns the number of blocks.
+ */
+int bio_take_dirty(int **block_nums, char **data) {
+	int i, n = 0;
+	pthread_mutex_lock(&cache_lock);
+	struct cache_blk **dirty = malloc(sizeof(struct cache_blk*)*(cache_used+1));
+	for (i = 0; i < cache_used; i++) {
+		if (cache_blocks[i].dirty) {
+			dirty[n++] = &cache_blocks[i];
+		}
+	}
+	qsort(dirty, n, sizeof(struct cache_blk*), cmp_block_num);
+	*block_nums = malloc(sizeof(int)*(n+1));
+	*data = malloc((size_t)BLOCK_SIZE*(n+1));
+	for (i = 0; i < n; i++) {
+		(*block_nums)[i] = dirty[i]->block_num;
+		memcpy(*data+(size_t)i*BLOCK_SIZE, dirty[i]->data, BLOCK_SIZE);
+		cache_set_dirty(dirty[i], 0);
+		cache_pinned += !dirty[i]->pinned;
+		dirty[i]->pinned = 1;
+	}
+	free(dirty);
+	pthread_mutex_unlock(&cache_lock);
+	return n;
+}
+
+//Let the blocks handed out by bio_take_dirty() be evicted again
+void bio_unpin() {
+	int i;
+	pthread_mutex_lock(&cache_lock);
+	for (i = 0; i < cache_used; i++) {
+		cache_blocks[i].pinned = 0;
+	}
+	cache_pinned = 0;
+	pthread_cond_broadcast(&cache_unpinned);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+//Drop block_num from the cache, dirty or not (it has been freed)
+void bio_forget(int block_num) {
+	if (cache_blocks == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&cache_lock);
+	struct cache_blk *b = cache_lookup(block_num);
+	if (b != NULL) {
+		cache_drop(b);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+//bio_writev() straight to the disk file, leaving the cache alone
+int bio_write_raw(const int *block_nums, const void *const *bufs, int count) {
+	struct iovec *iov = malloc(sizeof(struct iovec)*(count+1));
+	struct bio_run *runs = malloc(sizeof(struct bio_run)*(count+1));
+	int nruns = make_runs(block_nums, bufs, count, iov, runs);
+	int retstat = disk_runs(runs, nruns, 1) < 0 ? -1 : count*BLOCK_SIZE;
+	free(runs);
+	free(iov);
+	return retstat;
+}
+
+//Make everything written to the disk file so far durable
+int bio_sync() {
+	uint64_t start = stat_now();
+	int retstat = 0;
+	if (disk_map != NULL) {
+		retstat = map_sync();
+	} else if (diskfile >= 0) {
+		stat_count(SC_SYSCALLS, 1);
+		if (fdatasync(diskfile) < 0) {
+			perror("fdatasync failed");
+			retstat = -1;
+		}
+	}
+	stat_op(ST_BIO_SYNC, start, retstat);
+	return retstat;
+}
+
+static int cmp_int(const void *a, const void *b) {
+	int x = *(const int*)a, y = *(const int*)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Write just the given blocks out to the disk file (block_nums gets
+ * sorted). Dirty cached copies are written back first, except in journal
+ * mode where only a commit may write metadata home. Each run of
+ * consecutive blocks is then written out on its own with sync_file_range,
+ * so the block cache's other dirty blocks are left alone, unlike
+ * bio_flush(). sync_file_range neither flushes the drive's write cache nor
+ * commits the disk file's own metadata, so the caller finishes with one
+ * bio_sync_barrier(); the mmap backend's msync(MS_SYNC) already is a
+ * ranged fdatasync.
+ */
+int bio_sync_blocks(int *block_nums, int count) {
+	int i, j, n = 0, retstat = 0;
+	if (count == 0) {
+		return 0;
+	}
+	qsort(block_nums, count, sizeof(int), cmp_int);
+	for (i = 0; i < count; i++) {
+		if (n == 0 || block_nums[i] != block_nums[n-1]) {
+			block_nums[n++] = block_nums[i];
+		}
+	}
+	if (cache_blocks != NULL && !cache_no_steal) {
+		pthread_mutex_lock(&cache_lock);
+		for (i = 0; i < n; i++) {
+			struct cache_blk *b = cache_lookup(block_nums[i]);
+			if (b != NULL && b->dirty) {
+				if (disk_write(b->block_num, b->data) < 0) {
+					retstat = -1;
+				} else {
+					cache_set_dirty(b, 0);
+				}
+			}
+		}
+		pthread_mutex_unlock(&cache_lock);
+	}
+	for (i = 0; i < n; i = j) {
+		for (j = i+1; j < n && block_nums[j] == block_nums[j-1]+1; j++);
+		off_t off = (off_t)block_nums[i]*BLOCK_SIZE, len = (off_t)(j-i)*BLOCK_SIZE;
+		stat_count(SC_SYSCALLS, 1);
+		if (disk_map != NULL) {
+			if (off+len <= (off_t)disk_map_len && msync(disk_map+off, len, MS_SYNC) < 0) {
+				perror("msync failed");
+				retstat = -1;
+			}
+		} else if (sync_file_range(diskfile, off, len, SYNC_FILE_RANGE_WAIT_BEFORE |
+				SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) < 0) {
+			perror("sync_file_range failed");
+			retstat = -1;
+		}
+	}
+	return retstat;
+}
+
+/*
+ * Make the runs bio_sync_blocks() wrote durable: an fdatasync, which also
+ * flushes the drive's write cache. Nothing to do on the mmap backend.
+ */
+int bio_sync_barrier() {
+	if (disk_map != NULL || diskfile < 0) {
+		return 0;
+	}
+	stat_count(SC_SYSCALLS, 1);
+	if (fdatasync(diskfile) < 0) {
+		perror("fdatasync failed");
+		return -1;
+	}
+	return 0;
+}
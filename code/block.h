@@ -8,12 +8,85 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <stdint.h>
+
 #define BLOCK_SIZE 4096
 
-void dev_init(const char* diskfile_path);
+//Default number of blocks kept in the write-back block cache (4MB)
+#define BLOCK_CACHE_SIZE 1024
+
+void dev_init(const char* diskfile_path, uint64_t size);
 int dev_open(const char* diskfile_path);
 void dev_close();
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
 
+/*
+ * block cache: bio_read/bio_write go through an LRU write-back cache.
+ * bio_cache_config() sets the cache size in blocks (0 disables it) and
+ * must be called before dev_init()/dev_open(). bio_flush() writes every
+ * dirty block back to the disk file.
+ */
+void bio_cache_config(int nblocks);
+int bio_flush();
+
+/*
+ * mmap backend: bio_mmap_config(1) before dev_init()/dev_open() maps the
+ * whole disk file and turns block I/O into memcpy; bio_flush() then also
+ * msyncs the mapping. Falls back to pread/pwrite if the mmap fails.
+ */
+void bio_mmap_config(int enable);
+
+/*
+ * io_uring backend: bio_uring_config(depth, poll) before dev_init()/
+ * dev_open() sends the vectored I/O (bio_readv/bio_writev and the cache
+ * write-back in bio_flush) through an io_uring with up to depth requests
+ * in flight. With poll set completions are spun on instead of waited for.
+ * Falls back to preadv/pwritev if the ring can't be set up; the mmap
+ * backend takes precedence.
+ */
+#define BIO_URING_DEPTH 64
+void bio_uring_config(int depth, int poll);
+
+/*
+ * Vectored I/O: block_nums[i] <-> bufs[i] for i < count. Physically adjacent
+ * blocks are coalesced into one preadv/pwritev. These don't add blocks to
+ * the cache (meant for file data) but stay coherent with it: reads see
+ * cached copies and writes update them.
+ */
+int bio_readv(const int *block_nums, void *const *bufs, int count);
+int bio_writev(const int *block_nums, const void *const *bufs, int count);
+
+/*
+ * Journal support. bio_journal_config(1) makes the cache no-steal: it
+ * never writes a dirty block back by itself, so blocks only reach their
+ * home location through the journal. bio_take_dirty() hands out copies of
+ * every dirty block and marks them clean but pinned (not evictable, so
+ * they can't be re-read from disk before their home write) until
+ * bio_unpin(). A write that finds every slot dirty or pinned waits for
+ * bio_unpin(), or fails if nothing is pinned; the caller has to keep the
+ * dirty blocks to fewer than bio_cache_blocks(). bio_write_raw() writes
+ * straight to the disk file without touching the cache, bio_forget() drops
+ * a freed block from the cache and bio_sync() makes all writes so far
+ * durable.
+ */
+void bio_journal_config(int enable);
+int bio_cache_blocks();
+int bio_dirty_count();
+int bio_take_dirty(int **block_nums, char **data);
+void bio_unpin();
+void bio_forget(int block_num);
+int bio_write_raw(const int *block_nums, const void *const *bufs, int count);
+int bio_sync();
+
+/*
+ * fsync support: write only block_nums[0..count) out to the disk file
+ * (dirty cached copies included, except in journal mode), leaving the rest
+ * of it alone. block_nums is sorted and deduplicated in place. The blocks
+ * are durable once bio_sync_barrier() returns; one barrier covers any
+ * number of bio_sync_blocks() calls before it.
+ */
+int bio_sync_blocks(int *block_nums, int count);
+int bio_sync_barrier();
+
 #endif
@@ -0,0 +1,104 @@
+/*
+ *	Tiny File System
+ *	File:	libtfs.h
+ *
+ */
+
+#ifndef _LIBTFS_H
+#define _LIBTFS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "block.h"
+#include "tfs.h"
+
+/*
+ * The file system engine as a library (libtfs.a). tfs links it behind
+ * FUSE; anything else can mount a disk file and call the operations
+ * directly, in process.
+ *
+ * The operations below are safe to call from several threads at once and
+ * return 0 (or a byte count) on success and a negative errno on failure,
+ * like FUSE handlers. An open file is a struct open_file handle from
+ * tfs_open()/tfs_create(), an open directory a struct dir_cursor from
+ * tfs_opendir(); calls that take one also accept NULL, in which case the
+ * path alone is used. tfs_readdir() gives filler each entry's attributes
+ * (as tfs_getattr() would) and the offset to pass back to go on after it,
+ * so a listing that stops when filler returns 1 resumes where it left off.
+ */
+struct open_file;
+struct dir_cursor;
+
+typedef int (*tfs_fill_dir_t)(void *buf, const char *name, const struct stat *stbuf, off_t off);
+
+/*
+ * Geometry of the file systems tfs_mkfs() makes; zero fields keep the
+ * defaults from tfs.h. A zero journal_blocks lets mkfs size the journal
+ * to the bitmaps (at least JOURNAL_BLOCKS). The data region gets whatever
+ * the superblock, journal, bitmaps and inode table leave of disk_size.
+ */
+struct tfs_geometry {
+	uint64_t	disk_size;			/* bytes */
+	uint32_t	inodes;
+	uint32_t	journal_blocks;
+	uint32_t	blocks_per_group;	/* rounded up to a multiple of 64 */
+};
+
+/*
+ * tfs_mount() opens diskfile (making a new file system if it doesn't
+ * exist), replays the journal and, with a TRACE_LEVEL>0 build and a
+ * non-empty tracefile, starts tracing. It fails with -EINVAL for an image
+ * of another format or BLOCK_SIZE, a geometry mkfs can't lay out, or a
+ * journal (or block cache) too small to hold the bitmaps and a transaction.
+ * Nothing else may be called before it or after tfs_unmount(), which
+ * writes everything back. The config calls go before tfs_mount():
+ * tfs_delalloc_config(1) turns on delayed allocation.
+ */
+void tfs_delalloc_config(int on);
+void tfs_geometry_config(const struct tfs_geometry *geo);
+int tfs_mount(const char *diskfile, const char *tracefile);
+int tfs_unmount();
+int tfs_mkfs(const char *diskfile);
+
+int tfs_getattr(const char *path, struct stat *stbuf);
+int tfs_opendir(const char *path, struct dir_cursor **dc);
+int tfs_readdir(const char *path, void *buffer, tfs_fill_dir_t filler, off_t offset, struct dir_cursor *dc);
+int tfs_releasedir(const char *path, struct dir_cursor *dc);
+int tfs_mkdir(const char *path, mode_t mode);
+int tfs_rmdir(const char *path);
+int tfs_create(const char *path, mode_t mode, struct open_file **of);
+int tfs_open(const char *path, struct open_file **of);
+int tfs_read(const char *path, char *buffer, size_t size, off_t offset, struct open_file *of);
+int tfs_write(const char *path, const char *buffer, size_t size, off_t offset, struct open_file *of);
+int tfs_unlink(const char *path);
+int tfs_truncate(const char *path, off_t size);
+int tfs_flush(const char *path, struct open_file *of);
+int tfs_fsync(const char *path, int datasync, struct open_file *of);
+int tfs_utimens(const char *path, const struct timespec tv[2]);
+int tfs_release(const char *path, struct open_file *of);
+
+/*
+ * Lower level entry points, for tools and tests that look at on-disk
+ * structures. They do no locking of their own: callers either hold the
+ * inode locks the way the operations above do, or are the only thread.
+ * Inode and block numbers are those of the structures in tfs.h; -1 means
+ * not found / nothing free.
+ */
+int readi(uint32_t ino, struct inode *inode);
+int writei(uint32_t ino, struct inode *inode);
+int get_node_by_path(const char *path, uint32_t ino, struct inode *inode);
+int bmap(struct inode *inode, uint32_t lblk, uint32_t *len);
+
+int dir_find(uint32_t ino, const char *fname, size_t name_len, struct dirent *dirent);
+int dir_add(struct inode dir_inode, uint32_t f_ino, const char *fname, size_t name_len);
+int dir_remove(struct inode dir_inode, const char *fname, size_t name_len);
+
+int get_avail_ino(uint32_t parent, int dir);
+int get_avail_blkno();
+int get_avail_blkrun(int goal, int want, int *got);
+void release_ino(int ino);
+void release_blkno(int blkno);
+void release_blkrun(int start, int count);
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ *	Tiny File System
+ *	File:	stats.c
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "stats.h"
+
+struct op_stats {
+	uint64_t	calls;
+	uint64_t	errors;
+	uint64_t	bytes;
+	uint64_t	total_ns;
+	uint64_t	max_ns;
+	uint64_t	buckets[STAT_BUCKETS];
+};
+
+#define STAT_NAME(id, name) name,
+static const char *op_names[] = { STAT_OPS(STAT_NAME) };
+static const char *counter_names[] = { STAT_COUNTERS(STAT_NAME) };
+#undef STAT_NAME
+
+static struct op_stats ops[ST_NOPS];
+static uint64_t counters[SC_NCOUNTERS];
+
+uint64_t stat_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+void stat_op(int op, uint64_t start, long ret) {
+	uint64_t ns = stat_now() - start;
+	struct op_stats *s = &ops[op];
+	int b = 63 - __builtin_clzll(ns | 1);
+	__atomic_add_fetch(&s->calls, 1, __ATOMIC_RELAXED);
+	if (ret < 0) {
+		__atomic_add_fetch(&s->errors, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch(&s->bytes, ret, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&s->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->buckets[b < STAT_BUCKETS ? b : STAT_BUCKETS-1], 1, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&s->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void stat_count(int counter, uint64_t n) {
+	__atomic_add_fetch(&counters[counter], n, __ATOMIC_RELAXED);
+}
+
+//Upper edge (in us) of the bucket holding the p-th fraction of the calls, at most the max
+static double percentile(const struct op_stats *s, double p) {
+	uint64_t seen = 0, want = (uint64_t)(p*s->calls), edge;
+	int i;
+	for (i = 0; i < STAT_BUCKETS; i++) {
+		seen += s->buckets[i];
+		if (seen > want) {
+			break;
+		}
+	}
+	edge = 2ULL << (i < STAT_BUCKETS ? i : STAT_BUCKETS-1);
+	return (double)(edge < s->max_ns ? edge : s->max_ns)/1000;
+}
+
+/*
+ * One line per operation that has been called, then the raw histograms
+ * (non-empty buckets as log2(ns):count) and the counters. Percentiles are
+ * bucket upper edges, so they round up to the next power of two ns (but
+ * never past the slowest call seen).
+ */
+char *stats_render(size_t *len) {
+	char *buf = NULL;
+	FILE *f = open_memstream(&buf, len);
+	if (f == NULL) {
+		return NULL;
+	}
+	struct op_stats s;
+	int i, j;
+	fprintf(f, "%-12s %10s %8s %14s %10s %10s %10s %10s %10s\n",
+		"op", "calls", "errors", "bytes", "avg_us", "p50_us", "p90_us", "p99_us", "max_us");
+	for (i = 0; i < ST_NOPS; i++) {
+		//a snapshot taken word by word, good enough for monitoring
+		for (j = 0; j < (int)(sizeof(s)/sizeof(uint64_t)); j++) {
+			((uint64_t*)&s)[j] = __atomic_load_n(&((uint64_t*)&ops[i])[j], __ATOMIC_RELAXED);
+		}
+		if (s.calls == 0) {
+			continue;
+		}
+		fprintf(f, "%-12s %10llu %8llu %14llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", op_names[i],
+			(unsigned long long)s.calls, (unsigned long long)s.errors, (unsigned long long)s.bytes,
+			(double)s.total_ns/s.calls/1000, percentile(&s, 0.5), percentile(&s, 0.9), percentile(&s, 0.99),
+			(double)s.max_ns/1000);
+	}
+	fprintf(f, "\n");
+	for (i = 0; i < ST_NOPS; i++) {
+		if (__atomic_load_n(&ops[i].calls, __ATOMIC_RELAXED) == 0) {
+			continue;
+		}
+		fprintf(f, "hist %s", op_names[i]);
+		for (j = 0; j < STAT_BUCKETS; j++) {
+			uint64_t n = __atomic_load_n(&ops[i].buckets[j], __ATOMIC_RELAXED);
+			if (n != 0) {
+				fprintf(f, " %d:%llu", j, (unsigned long long)n);
+			}
+		}
+		fprintf(f, "\n");
+	}
+	fprintf(f, "\n");
+	for (i = 0; i < SC_NCOUNTERS; i++) {
+		fprintf(f, "%s %llu\n", counter_names[i],
+			(unsigned long long)__atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+	}
+	fclose(f);
+	return buf;
+}
@@ -0,0 +1,65 @@
+/*
+ *	Tiny File System
+ *	File:	stats.h
+ *
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Per-operation statistics. Every FUSE handler and the block layer entry
+ * points count calls, errors (negative returns), bytes (positive returns)
+ * and a latency histogram with one bucket per power of two nanoseconds.
+ * A few global counters sit next to them. Everything is updated with
+ * relaxed atomics and read back by stats_render(), which tfs serves as
+ * the read-only file STATS_FILE at the root of the mount.
+ */
+#define STATS_FILE "/.tfs_stats"
+#define STAT_BUCKETS 48			/* bucket i: [2^i, 2^(i+1)) ns, the last one open ended */
+
+#define STAT_OPS(X) \
+	X(ST_GETATTR,		"getattr") \
+	X(ST_READDIR,		"readdir") \
+	X(ST_OPENDIR,		"opendir") \
+	X(ST_RELEASEDIR,	"releasedir") \
+	X(ST_MKDIR,			"mkdir") \
+	X(ST_RMDIR,			"rmdir") \
+	X(ST_CREATE,		"create") \
+	X(ST_OPEN,			"open") \
+	X(ST_READ,			"read") \
+	X(ST_WRITE,			"write") \
+	X(ST_UNLINK,		"unlink") \
+	X(ST_TRUNCATE,		"truncate") \
+	X(ST_FLUSH,			"flush") \
+	X(ST_FSYNC,			"fsync") \
+	X(ST_UTIMENS,		"utimens") \
+	X(ST_RELEASE,		"release") \
+	X(ST_BIO_READ,		"bio_read") \
+	X(ST_BIO_WRITE,		"bio_write") \
+	X(ST_BIO_READV,		"bio_readv") \
+	X(ST_BIO_WRITEV,	"bio_writev") \
+	X(ST_BIO_FLUSH,		"bio_flush") \
+	X(ST_BIO_SYNC,		"bio_sync")
+
+#define STAT_COUNTERS(X) \
+	X(SC_CACHE_HITS,	"cache_hits") \
+	X(SC_CACHE_MISSES,	"cache_misses") \
+	X(SC_SYSCALLS,		"syscalls")			/* I/O and sync syscalls on the disk file */
+
+#define STAT_ENUM(id, name) id,
+enum stat_op_id { STAT_OPS(STAT_ENUM) ST_NOPS };
+enum stat_counter_id { STAT_COUNTERS(STAT_ENUM) SC_NCOUNTERS };
+#undef STAT_ENUM
+
+uint64_t stat_now();
+//Account one call of op that started at stat_now() == start and returned ret
+void stat_op(int op, uint64_t start, long ret);
+void stat_count(int counter, uint64_t n);
+//The current statistics as text in a malloc'ed buffer, *len set to its length
+char *stats_render(size_t *len);
+
+#endif
@@ -6,521 +6,2397 @@
  *
  */
 
-#define FUSE_USE_VERSION 26
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <time.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include "libtfs.h"
+#include "trace.h"
+
+#define _DIRECTORY_ 0
+#define _FILE_ 1
+
+// Declare your in-memory data structures here
+int disk_file = -1;
+struct superblock* s_block;
+int total_blocks_used = 0;		//updated with atomics, see alloc_blkrun()
+
+/*
+ * Locking. There is no global filesystem lock:
+ *  - every cached inode has a rwlock (ilock()/iunlock()) guarding its
+ *    contents, a directory's entries and a file's data blocks;
+ *  - each allocation group's lock guards its part of the in-memory bitmaps
+ *    (bitmap_sync() takes them all, in group order), alloc_lock the list
+ *    of blocks waiting to be freed; a file's block reservation is guarded
+ *    by its inode lock;
+ *  - icache_lock, dcache_lock and the block cache lock guard their tables.
+ * Lock ordering: a parent directory's inode lock is always taken before
+ * its child's (mkdir/create lock only the parent, rmdir/unlink lock the
+ * parent then the child), and no other pair of inode locks is ever held
+ * at once. Group locks, alloc_lock and the table locks are leaves: nothing
+ * but the block cache lock (and a group lock, when icache_lock evicts an
+ * inode with a reservation) is acquired while holding one, so they nest
+ * inside inode locks freely.
+ * An open file's lock (readahead state) is only taken inside its inode's.
+ * Path lookup holds at most one inode lock at a time (briefly, on a
+ * dentry cache miss), so it can't deadlock with the above.
+ * With the journal, every operation that changes metadata holds txn_lock
+ * shared (txn_begin()/txn_end()) outside all of the above; a commit takes
+ * it exclusively, holding nothing else, to snapshot a consistent state.
+ */
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//set at mount when the superblock has a journal, see the journal section
+int journal_on = 0;
+//data blocks freed since the last journal snapshot, see release_blkno()
+static int *pending_free = NULL;
+static int npending = 0, pending_cap = 0;
+/*
+ * In-memory copy of an on-disk bitmap. The bitmaps are loaded once at
+ * mount time and scanned a 64-bit word at a time; changes are only
+ * written back to disk by bitmap_sync() (on flush and unmount).
+ * Bit i of the bitmap is bit i%64 of word i/64, which is the same layout
+ * set_bitmap()/get_bitmap() use on a little-endian machine. A bitmap
+ * spans as many blocks as it needs; dirty[] says which of them have
+ * changed, so bitmap_sync() only writes those.
+ */
+#define BITS_PER_BLOCK (BLOCK_SIZE*8)
+
+struct mem_bitmap {
+	uint64_t	*words;
+	int			nbits;			/* number of usable bits */
+	int			nwords;
+	uint32_t	blk;			/* first on-disk block of the bitmap */
+	int			nblocks;
+	char		*dirty;			/* per block: needs to be written back */
+	uint64_t	*rsv;			/* set bits that are only reserved, see struct blk_rsv */
+};
+
+struct mem_bitmap ino_bmap;
+struct mem_bitmap blk_bmap;
+
+/*
+ * Allocation groups. Both bitmaps are cut into s_block->groups groups of
+ * inodes_per_group inodes and blocks_per_group data blocks (whole bitmap
+ * words, so no two groups share one). A group has its own lock, free
+ * counts and next-fit hints, so threads allocating in different groups
+ * don't contend: new files get an inode in their parent directory's group,
+ * new directories go to the group with the most free inodes, and data
+ * blocks come from the group of their inode. Only a full group sends an
+ * allocation on to the next one.
+ */
+struct alloc_group {
+	pthread_mutex_t	lock;
+	int				ino_lo, ino_hi;		/* bitmap words [lo, hi) of the group */
+	int				blk_lo, blk_hi;
+	int				ino_hint, blk_hint;	/* words the next searches start at */
+	int				ino_free, blk_free;	/* read without the lock to pick groups */
+};
+
+static struct alloc_group *groups = NULL;
+static int ngroups = 0, ino_per_group, blk_per_group;
+
+static inline int min_int(int a, int b) {
+	return a < b ? a : b;
+}
+
+//Stop all allocation, to write the bitmaps out
+static void groups_lock_all() {
+	int g;
+	for(g = 0; g < ngroups; g++){
+		pthread_mutex_lock(&groups[g].lock);
+	}
+}
+
+static void groups_unlock_all() {
+	int g;
+	for(g = ngroups-1; g >= 0; g--){
+		pthread_mutex_unlock(&groups[g].lock);
+	}
+}
+
+//Number of blocks a bitmap of nbits bits takes on disk
+static inline int bitmap_blocks(uint32_t nbits) {
+	return (nbits+BITS_PER_BLOCK-1)/BITS_PER_BLOCK;
+}
+
+static inline void bitmap_dirty(struct mem_bitmap *bm, int first, int last) {
+	int b;
+	for(b = first/BITS_PER_BLOCK; b <= last/BITS_PER_BLOCK; b++){
+		__atomic_store_n(&bm->dirty[b], 1, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Set up bm for the bitmap stored from block blk on. If load is 0 the
+ * bitmap starts out empty instead of being read from disk.
+ */
+int bitmap_init(struct mem_bitmap *bm, uint32_t blk, int nbits, int load) {
+	int i;
+	bm->nbits = nbits;
+	bm->nwords = (nbits+63)/64;
+	bm->blk = blk;
+	bm->nblocks = bitmap_blocks(nbits);
+	free(bm->words);
+	free(bm->dirty);
+	free(bm->rsv);
+	bm->words = malloc((size_t)bm->nblocks*BLOCK_SIZE);
+	bm->dirty = malloc(bm->nblocks);
+	bm->rsv = calloc(bm->nwords, sizeof(uint64_t));
+	if(bm->words == NULL || bm->dirty == NULL || bm->rsv == NULL){
+		return -1;
+	}
+	memset(bm->dirty, !load, bm->nblocks);
+	if(load){
+		int *blocks = malloc(sizeof(int)*bm->nblocks);
+		void **bufs = malloc(sizeof(void*)*bm->nblocks);
+		for(i = 0; i < bm->nblocks; i++){
+			blocks[i] = blk+i;
+			bufs[i] = (char*)bm->words + (size_t)i*BLOCK_SIZE;
+		}
+		int ret = bio_readv(blocks, bufs, bm->nblocks);
+		free(bufs);
+		free(blocks);
+		if(ret < 0){
+			return -1;
+		}
+	}else{
+		memset(bm->words, 0, (size_t)bm->nblocks*BLOCK_SIZE);
+	}
+	//bits past nbits in the last word are never handed out
+	if(nbits%64 != 0){
+		bm->words[bm->nwords-1] |= ~0ULL << (nbits%64);
+	}
+	return 0;
+}
+
+/*
+ * Write the dirty blocks of bm back. Reserved bits go out clear: they
+ * only become allocated on disk once they are handed out, so a crash
+ * can't leak them.
+ */
+int bitmap_sync(struct mem_bitmap *bm) {
+	int ret = 0;
+	if(bm->words == NULL){
+		return 0;
+	}
+	uint64_t *buf = malloc(BLOCK_SIZE);
+	groups_lock_all();
+	int i, w;
+	for(i = 0; i < bm->nblocks; i++){
+		if(__atomic_exchange_n(&bm->dirty[i], 0, __ATOMIC_ACQUIRE)){
+			const uint64_t *words = bm->words + (size_t)i*(BLOCK_SIZE/8);
+			int first = i*(BLOCK_SIZE/8);
+			for(w = 0; w < BLOCK_SIZE/8; w++){
+				buf[w] = words[w];
+				if(first+w < bm->nwords){
+					buf[w] &= ~__atomic_load_n(&bm->rsv[first+w], __ATOMIC_RELAXED);
+				}
+			}
+			ret |= bio_write(bm->blk+i, buf) < 0 ? -1 : 0;
+		}
+	}
+	groups_unlock_all();
+	free(buf);
+	return ret;
+}
+
+void bitmap_release(struct mem_bitmap *bm) {
+	free(bm->words);
+	free(bm->dirty);
+	free(bm->rsv);
+	bm->words = NULL;
+	bm->dirty = NULL;
+	bm->rsv = NULL;
+}
+
+/*
+ * Next-fit search of words [lo, hi): starting at the hint word, find the
+ * first word that is not full and take its lowest clear bit.
+ */
+int bitmap_alloc(struct mem_bitmap *bm, int lo, int hi, int *hint) {
+	int k, w = *hint >= lo && *hint < hi ? *hint : lo;
+	for(k = lo; k < hi; k++){
+		uint64_t free_bits = ~bm->words[w];
+		if(free_bits != 0){
+			int bit = __builtin_ctzll(free_bits);
+			bm->words[w] |= 1ULL << bit;
+			*hint = w;
+			bitmap_dirty(bm, w*64, w*64);
+			return w*64 + bit;
+		}
+		if(++w == hi){
+			w = lo;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Allocate up to want contiguous bits of words [lo, hi), starting at the
+ * first free bit at or after goal (or after the hint if goal is -1 or
+ * outside the range). *got is set to the number actually taken; returns
+ * the first bit or -1 if the range is full.
+ */
+int bitmap_alloc_run(struct mem_bitmap *bm, int lo, int hi, int goal, int want, int *got, int *hint) {
+	if(goal < lo*64 || goal >= hi*64 || goal >= bm->nbits){
+		goal = (*hint >= lo && *hint < hi ? *hint : lo)*64;
+	}
+	int k, w = goal/64, end = hi*64 < bm->nbits ? hi*64 : bm->nbits;
+	uint64_t free_bits = ~bm->words[w] & (~0ULL << (goal%64));
+	for(k = lo; free_bits == 0 && k < hi; k++){
+		if(++w == hi){
+			w = lo;
+		}
+		free_bits = ~bm->words[w];
+	}
+	if(free_bits == 0){
+		return -1;
+	}
+	int start = w*64 + __builtin_ctzll(free_bits), n = 0;
+	while(n < want && start+n < end && !(bm->words[(start+n)/64] & (1ULL << ((start+n)%64)))){
+		bm->words[(start+n)/64] |= 1ULL << ((start+n)%64);
+		n++;
+	}
+	*hint = (start+n-1)/64;
+	bitmap_dirty(bm, start, start+n-1);
+	*got = n;
+	return start;
+}
+
+//Clear bit i, returns 1 if it was set
+int bitmap_free(struct mem_bitmap *bm, int i) {
+	if(i < 0 || i >= bm->nbits || !(bm->words[i/64] & (1ULL << (i%64)))){
+		return 0;
+	}
+	bm->words[i/64] &= ~(1ULL << (i%64));
+	bitmap_dirty(bm, i, i);
+	return 1;
+}
+
+//Free bits of words [lo, hi)
+static int bitmap_count_free(struct mem_bitmap *bm, int lo, int hi) {
+	int w, n = 0;
+	for(w = lo; w < hi; w++){
+		n += 64 - __builtin_popcountll(bm->words[w]);
+	}
+	return n;
+}
+
+/*
+ * Set up the groups over the loaded bitmaps. Images made before there
+ * were groups (no group geometry in the superblock) are one big group.
+ */
+static int groups_init() {
+	int g;
+	ino_per_group = s_block->inodes_per_group;
+	blk_per_group = s_block->blocks_per_group;
+	ngroups = s_block->groups;
+	if(ngroups == 0 || ino_per_group == 0 || blk_per_group == 0 || ino_per_group%64 != 0 || blk_per_group%64 != 0){
+		ngroups = 1;
+		ino_per_group = ino_bmap.nwords*64;
+		blk_per_group = blk_bmap.nwords*64;
+	}
+	free(groups);
+	groups = calloc(ngroups, sizeof(struct alloc_group));
+	if(groups == NULL){
+		return -1;
+	}
+	for(g = 0; g < ngroups; g++){
+		struct alloc_group *ag = &groups[g];
+		pthread_mutex_init(&ag->lock, NULL);
+		//the last group also takes any words the rounding left over
+		ag->ino_lo = min_int(g*(ino_per_group/64), ino_bmap.nwords);
+		ag->ino_hi = g == ngroups-1 ? ino_bmap.nwords : min_int((g+1)*(ino_per_group/64), ino_bmap.nwords);
+		ag->blk_lo = min_int(g*(blk_per_group/64), blk_bmap.nwords);
+		ag->blk_hi = g == ngroups-1 ? blk_bmap.nwords : min_int((g+1)*(blk_per_group/64), blk_bmap.nwords);
+		ag->ino_hint = ag->ino_lo;
+		ag->blk_hint = ag->blk_lo;
+		ag->ino_free = bitmap_count_free(&ino_bmap, ag->ino_lo, ag->ino_hi);
+		ag->blk_free = bitmap_count_free(&blk_bmap, ag->blk_lo, ag->blk_hi);
+	}
+	return 0;
+}
+
+static void groups_release() {
+	int g;
+	for(g = 0; g < ngroups; g++){
+		pthread_mutex_destroy(&groups[g].lock);
+	}
+	free(groups);
+	groups = NULL;
+	ngroups = 0;
+}
+
+static inline int ino_group(uint32_t ino) {
+	int g = ino/ino_per_group;
+	return g < ngroups ? g : ngroups-1;
+}
+
+static inline int blk_group(int blkno) {
+	int g = blkno/blk_per_group;
+	return g < ngroups ? g : ngroups-1;
+}
+
+//Take an inode from group g, -1 if it has none left
+static int group_alloc_ino(int g) {
+	struct alloc_group *ag = &groups[g];
+	int pos = -1;
+	if(__atomic_load_n(&ag->ino_free, __ATOMIC_RELAXED) == 0){
+		return -1;
+	}
+	pthread_mutex_lock(&ag->lock);
+	if((pos = bitmap_alloc(&ino_bmap, ag->ino_lo, ag->ino_hi, &ag->ino_hint)) >= 0){
+		__atomic_sub_fetch(&ag->ino_free, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&ag->lock);
+	return pos;
+}
+
+/*
+ * Take up to want contiguous blocks from group g (see bitmap_alloc_run()).
+ * Blocks of the run past the first use are only reserved.
+ */
+static int group_alloc_blkrun(int g, int goal, int want, int use, int *got) {
+	struct alloc_group *ag = &groups[g];
+	int i, pos = -1;
+	if(__atomic_load_n(&ag->blk_free, __ATOMIC_RELAXED) == 0){
+		return -1;
+	}
+	pthread_mutex_lock(&ag->lock);
+	if((pos = bitmap_alloc_run(&blk_bmap, ag->blk_lo, ag->blk_hi, goal, want, got, &ag->blk_hint)) >= 0){
+		__atomic_sub_fetch(&ag->blk_free, *got, __ATOMIC_RELAXED);
+		for(i = pos+use; i < pos+*got; i++){
+			__atomic_or_fetch(&blk_bmap.rsv[i/64], 1ULL << (i%64), __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&ag->lock);
+	return pos;
+}
+
+/* 
+ * Get available inode number from bitmap: files go in their parent's
+ * group, directories in the group with the most free inodes (searching
+ * from the one after the parent's, so siblings spread out). A full group
+ * hands over to the next one.
+ */
+int get_avail_ino(uint32_t parent, int dir) {
+	if(ino_bmap.words == NULL){
+		//superblock/bitmaps not loaded somehow
+		return -1;
+	}
+	int g, k, pos = -1, first = ino_group(parent);
+	if(dir){
+		int most = -1, from = first;
+		for(k = 1; k <= ngroups; k++){
+			g = (from+k)%ngroups;
+			int n = __atomic_load_n(&groups[g].ino_free, __ATOMIC_RELAXED);
+			if(n > most){
+				most = n;
+				first = g;
+			}
+		}
+	}
+	for(k = 0; k < ngroups && pos < 0; k++){
+		pos = group_alloc_ino((first+k)%ngroups);
+	}
+	if(pos >= 0){
+		__atomic_add_fetch(&total_blocks_used, 1, __ATOMIC_RELAXED);
+	}
+	TRACE(TRACE_DEBUG, TR_ALLOC_INO, pos, 0, 0);
+	return pos;
+}
+
+/*
+ * Get up to want contiguous data blocks from group g, preferably starting
+ * at goal (-1 to carry on from the group's hint), or from the groups after
+ * it once it is full. *got is set to how many were allocated.
+ */
+static int alloc_blkrun(int g, int goal, int want, int *got) {
+	int k, pos = -1;
+	if(blk_bmap.words == NULL){
+		return -1;
+	}
+	for(k = 0; k < ngroups && pos < 0; k++){
+		pos = group_alloc_blkrun((g+k)%ngroups, k == 0 ? goal : -1, want, want, got);
+	}
+	if(pos >= 0){
+		__atomic_add_fetch(&total_blocks_used, *got, __ATOMIC_RELAXED);
+	}
+	TRACE(TRACE_DEBUG, TR_ALLOC_RUN, goal, pos, pos >= 0 ? *got : 0);
+	return pos;
+}
+
+/* 
+ * Get available data block number from bitmap
+ */
+int get_avail_blkno() {
+	int got;
+	return alloc_blkrun(0, -1, 1, &got);
+}
+
+/*
+ * Get up to want contiguous data blocks, preferably starting at goal
+ * (-1 for no preference). *got is set to how many were allocated.
+ */
+int get_avail_blkrun(int goal, int want, int *got) {
+	return alloc_blkrun(goal >= 0 ? blk_group(goal) : 0, goal, want, got);
+}
+
+/*
+ * Give an inode number / data block number back to its bitmap
+ */
+void release_ino(int ino) {
+	struct alloc_group *ag = &groups[ino_group(ino)];
+	pthread_mutex_lock(&ag->lock);
+	if(bitmap_free(&ino_bmap, ino)){
+		__atomic_add_fetch(&ag->ino_free, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&ag->lock);
+}
+
+//Clear data blocks start..start+count-1 in their groups' bitmaps
+static void free_blkrun(int start, int count) {
+	int i = 0;
+	while(i < count){
+		struct alloc_group *ag = &groups[blk_group(start+i)];
+		pthread_mutex_lock(&ag->lock);
+		for(; i < count && blk_group(start+i) == ag-groups; i++){
+			if(bitmap_free(&blk_bmap, start+i)){
+				__atomic_add_fetch(&ag->blk_free, 1, __ATOMIC_RELAXED);
+			}
+		}
+		pthread_mutex_unlock(&ag->lock);
+	}
+}
+
+/*
+ * With the journal on, freed data blocks only go back to the bitmap at the
+ * next journal snapshot (apply_pending_frees()). Until then the previous
+ * transaction's home writes may still be going to them, so they can't be
+ * handed out again. They are dropped from the block cache right away.
+ */
+void release_blkrun(int start, int count) {
+	int i;
+	TRACE(TRACE_DEBUG, TR_FREE_RUN, start, count, 0);
+	if(!journal_on){
+		free_blkrun(start, count);
+		return;
+	}
+	pthread_mutex_lock(&alloc_lock);
+	for(i = 0; i < count; i++){
+		if(npending == pending_cap){
+			pending_cap = pending_cap ? pending_cap*2 : 256;
+			pending_free = realloc(pending_free, sizeof(int)*pending_cap);
+		}
+		pending_free[npending++] = start+i;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	for(i = 0; i < count; i++){
+		bio_forget(s_block->d_start_blk + start+i);
+	}
+}
+
+void release_blkno(int blkno) {
+	release_blkrun(blkno, 1);
+}
+
+static void apply_pending_frees() {
+	int i, n, *blocks;
+	pthread_mutex_lock(&alloc_lock);
+	blocks = pending_free;
+	n = npending;
+	pending_free = NULL;
+	npending = pending_cap = 0;
+	pthread_mutex_unlock(&alloc_lock);
+	for(i = 0; i < n; i++){
+		free_blkrun(blocks[i], 1);
+	}
+	free(blocks);
+}
+
+/*
+ * Block reservations. A file that grows gets a window of up to RSV_BLOCKS
+ * blocks right after the ones it asked for, and later allocations that
+ * continue it (or have no goal) are carved off the front of the window
+ * under the inode lock alone, without going back to the group. Reserved
+ * blocks are set in blk_bmap, so nobody else takes them, and in
+ * blk_bmap.rsv, so bitmap_sync() writes them out as free. What is left
+ * of a window goes back when the file is released or leaves the inode
+ * cache.
+ */
+#define RSV_BLOCKS 64
+
+struct blk_rsv {
+	int		start;		/* blocks [start, start+len) are reserved */
+	int		len;
+};
+
+//Hand out the first n blocks of the window
+static int rsv_take(struct blk_rsv *rsv, int n) {
+	int i, start = rsv->start;
+	for(i = start; i < start+n; i++){
+		__atomic_and_fetch(&blk_bmap.rsv[i/64], ~(1ULL << (i%64)), __ATOMIC_RELAXED);
+	}
+	//now they have to reach the disk as allocated
+	bitmap_dirty(&blk_bmap, start, start+n-1);
+	rsv->start += n;
+	rsv->len -= n;
+	__atomic_add_fetch(&total_blocks_used, n, __ATOMIC_RELAXED);
+	return start;
+}
+
+/*
+ * Like alloc_blkrun(), through rsv: runs are taken from the window when
+ * it starts at goal (or there is no goal), and when the window is used up
+ * a short run reserves a new one behind itself.
+ */
+static int rsv_alloc(struct blk_rsv *rsv, int g, int goal, int want, int *got) {
+	if(rsv->len > 0 && (goal < 0 || goal == rsv->start)){
+		*got = want < rsv->len ? want : rsv->len;
+		return rsv_take(rsv, *got);
+	}
+	if(rsv->len > 0 || want >= RSV_BLOCKS || blk_bmap.words == NULL){
+		return alloc_blkrun(g, goal, want, got);
+	}
+	int k, pos = -1;
+	for(k = 0; k < ngroups && pos < 0; k++){
+		pos = group_alloc_blkrun((g+k)%ngroups, k == 0 ? goal : -1, RSV_BLOCKS, want, got);
+	}
+	if(pos < 0){
+		return -1;
+	}
+	if(*got > want){
+		rsv->start = pos+want;
+		rsv->len = *got-want;
+		*got = want;
+	}
+	__atomic_add_fetch(&total_blocks_used, *got, __ATOMIC_RELAXED);
+	TRACE(TRACE_DEBUG, TR_ALLOC_RUN, goal, pos, *got);
+	return pos;
+}
+
+//Give the rest of the window back; it never reached the disk as allocated
+static void rsv_return(struct blk_rsv *rsv) {
+	if(rsv->len == 0){
+		return;
+	}
+	struct alloc_group *ag = &groups[blk_group(rsv->start)];
+	int i;
+	pthread_mutex_lock(&ag->lock);
+	for(i = rsv->start; i < rsv->start+rsv->len; i++){
+		__atomic_and_fetch(&blk_bmap.rsv[i/64], ~(1ULL << (i%64)), __ATOMIC_RELAXED);
+		blk_bmap.words[i/64] &= ~(1ULL << (i%64));
+	}
+	__atomic_add_fetch(&ag->blk_free, rsv->len, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&ag->lock);
+	rsv->len = 0;
+}
+
+/* 
+ * inode operations
+ */
+#define ICACHE_SIZE 512		/* inodes kept in memory before clean ones get evicted */
+#define ICACHE_BUCKETS 1024
+
+/*
+ * Resident inode table. readi()/writei() work on the cached copy; a dirty
+ * inode only reaches its inode-table block in sync_inodes(), which groups
+ * dirty inodes by block so inodes sharing a block cost a single write.
+ * Entries with a non-zero reference count (see iget/iput) are never evicted,
+ * so anyone holding an entry's rwlock also holds a reference to it.
+ */
+struct cached_inode {
+	struct inode		inode;
+	pthread_rwlock_t	rwlock;
+	int					refcnt;
+	int					dirty;
+	uint32_t			data_gen;		/* files: bumped on every data change (readahead validity) */
+	uint32_t			gen;			/* bumped when the inode is freed (dir_cursor) */
+	struct dirty_page	**dpages;		/* files: delalloc pages not written back yet, by lblk */
+	int					ndirty, dcap;
+	int					*sync_blocks;	/* files: data blocks written since the last fsync */
+	int					nsync, sync_cap;
+	int					meta_dirty;		/* files: size or mapping changed since the last fsync */
+	struct blk_rsv		rsv;			/* files: blocks reserved for growing them */
+	struct cached_inode	*hnext;			/* hash chain */
+	struct cached_inode	*prev, *next;	/* LRU list, most recently used first */
+};
+
+struct cached_inode *icache_hash[ICACHE_BUCKETS];
+struct cached_inode icache_lru = { .prev = &icache_lru, .next = &icache_lru };
+int icache_count = 0;
+//dirty entries, an upper bound on the inode-table blocks sync_inodes() dirties
+static int icache_ndirty = 0;
+pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+//an inode was evicted before its data was fsynced, see tfs_fsync()
+static int sync_lost = 0;
+
+static inline int inodes_per_block() {
+	return BLOCK_SIZE/sizeof(struct inode);
+}
+
+static inline int inode_block(uint32_t ino) {
+	//since inode blocks dont start at 0, need to add i_start_blk from the superblock
+	return s_block->i_start_blk + ino/inodes_per_block();
+}
+
+static void icache_lru_unlink(struct cached_inode *ci) {
+	ci->prev->next = ci->next;
+	ci->next->prev = ci->prev;
+}
+
+static void icache_lru_front(struct cached_inode *ci) {
+	ci->next = icache_lru.next;
+	ci->prev = &icache_lru;
+	icache_lru.next->prev = ci;
+	icache_lru.next = ci;
+}
+
+static struct cached_inode *icache_lookup(uint32_t ino) {
+	struct cached_inode *ci = icache_hash[ino%ICACHE_BUCKETS];
+	while(ci != NULL && ci->inode.ino != ino){
+		ci = ci->hnext;
+	}
+	return ci;
+}
+
+static int cmp_cached_ino(const void *a, const void *b) {
+	int x = (*(struct cached_inode* const*)a)->inode.ino;
+	int y = (*(struct cached_inode* const*)b)->inode.ino;
+	return x - y;
+}
+
+/*
+ * Write back every dirty inode. Inodes are sorted by number so all the
+ * ones living in the same inode-table block are patched into one
+ * read-modify-write of that block. Caller holds icache_lock.
+ */
+static int icache_sync_locked() {
+	struct cached_inode *ci, **dirty = malloc(sizeof(struct cached_inode*)*(icache_count+1));
+	int i, j, n = 0, ret = 0;
+	if(dirty == NULL){
+		return -1;
+	}
+	for(ci = icache_lru.next; ci != &icache_lru; ci = ci->next){
+		if(ci->dirty){
+			dirty[n++] = ci;
+		}
+	}
+	qsort(dirty, n, sizeof(struct cached_inode*), cmp_cached_ino);
+	char* buffer = malloc(BLOCK_SIZE);
+	for(i = 0; i < n; i = j){
+		int block_no = inode_block(dirty[i]->inode.ino);
+		bio_read(block_no, buffer);
+		for(j = i; j < n && inode_block(dirty[j]->inode.ino) == block_no; j++){
+			int offset = dirty[j]->inode.ino%inodes_per_block();
+			memcpy(&buffer[sizeof(struct inode)*offset], &dirty[j]->inode, sizeof(struct inode));
+			dirty[j]->dirty = 0;
+		}
+		__atomic_store_n(&icache_ndirty, icache_ndirty-(j-i), __ATOMIC_RELAXED);
+		if(bio_write(block_no, buffer) < 0){
+			ret = -1;
+		}
+	}
+	free(buffer);
+	free(dirty);
+	return ret;
+}
+
+/*
+ * Get a cache entry for ino that isn't in the cache yet. Reuses the least
+ * recently used unreferenced entry once the cache is full (writing the
+ * dirty inodes back first if that entry is dirty). Caller holds icache_lock.
+ */
+static struct cached_inode *icache_alloc(uint32_t ino) {
+	struct cached_inode *ci = NULL;
+	if(icache_count >= ICACHE_SIZE){
+		for(ci = icache_lru.prev; ci != &icache_lru && (ci->refcnt > 0 || ci->ndirty > 0); ci = ci->prev);
+		if(ci == &icache_lru){
+			ci = NULL;
+		}else{
+			if(ci->dirty){
+				icache_sync_locked();
+			}
+			if(ci->nsync > 0){
+				__atomic_store_n(&sync_lost, 1, __ATOMIC_RELAXED);
+			}
+			rsv_return(&ci->rsv);
+			free(ci->sync_blocks);
+			pthread_rwlock_destroy(&ci->rwlock);
+			icache_lru_unlink(ci);
+			struct cached_inode **pp = &icache_hash[ci->inode.ino%ICACHE_BUCKETS];
+			while(*pp != ci){
+				pp = &(*pp)->hnext;
+			}
+			*pp = ci->hnext;
+		}
+	}
+	if(ci == NULL){
+		ci = malloc(sizeof(struct cached_inode));
+		if(ci == NULL){
+			return NULL;
+		}
+		icache_count++;
+	}
+	memset(ci, 0, sizeof(struct cached_inode));
+	pthread_rwlock_init(&ci->rwlock, NULL);
+	ci->inode.ino = ino;
+	ci->hnext = icache_hash[ino%ICACHE_BUCKETS];
+	icache_hash[ino%ICACHE_BUCKETS] = ci;
+	icache_lru_front(ci);
+	return ci;
+}
+
+/*
+ * Get a referenced, resident copy of inode ino (read from disk on a miss).
+ * Every iget() must be paired with an iput().
+ */
+struct cached_inode *iget(uint32_t ino) {
+	pthread_mutex_lock(&icache_lock);
+	struct cached_inode *ci = icache_lookup(ino);
+	if(ci == NULL){
+		ci = icache_alloc(ino);
+		if(ci == NULL){
+			pthread_mutex_unlock(&icache_lock);
+			return NULL;
+		}
+		char* buffer = malloc(BLOCK_SIZE);
+		bio_read(inode_block(ino), buffer);
+		memcpy(&ci->inode, &buffer[sizeof(struct inode)*(ino%inodes_per_block())], sizeof(struct inode));
+		free(buffer);
+	}else{
+		icache_lru_unlink(ci);
+		icache_lru_front(ci);
+	}
+	ci->refcnt++;
+	pthread_mutex_unlock(&icache_lock);
+	return ci;
+}
+
+void iput(struct cached_inode *ci) {
+	pthread_mutex_lock(&icache_lock);
+	ci->refcnt--;
+	pthread_mutex_unlock(&icache_lock);
+}
+
+/*
+ * iget() plus the inode's rwlock, shared or exclusive. See the lock
+ * ordering rules at the top of the file.
+ */
+struct cached_inode *ilock(uint32_t ino, int exclusive) {
+	struct cached_inode *ci = iget(ino);
+	if(ci == NULL){
+		return NULL;
+	}
+	if(exclusive){
+		pthread_rwlock_wrlock(&ci->rwlock);
+	}else{
+		pthread_rwlock_rdlock(&ci->rwlock);
+	}
+	return ci;
+}
+
+void iunlock(struct cached_inode *ci) {
+	pthread_rwlock_unlock(&ci->rwlock);
+	iput(ci);
+}
+
+int sync_inodes() {
+	pthread_mutex_lock(&icache_lock);
+	int ret = icache_sync_locked();
+	pthread_mutex_unlock(&icache_lock);
+	return ret;
+}
+
+//Drop every cached inode; dirty ones should have been synced already
+void icache_release() {
+	pthread_mutex_lock(&icache_lock);
+	struct cached_inode *ci = icache_lru.next;
+	while(ci != &icache_lru){
+		struct cached_inode *next = ci->next;
+		int i;
+		for(i = 0; i < ci->ndirty; i++){
+			free(ci->dpages[i]);
+		}
+		free(ci->dpages);
+		free(ci->sync_blocks);
+		rsv_return(&ci->rsv);
+		pthread_rwlock_destroy(&ci->rwlock);
+		free(ci);
+		ci = next;
+	}
+	icache_lru.next = icache_lru.prev = &icache_lru;
+	memset(icache_hash, 0, sizeof(icache_hash));
+	icache_count = 0;
+	icache_ndirty = 0;
+	pthread_mutex_unlock(&icache_lock);
+}
+
+/*
+ * Metadata journal (see struct jnl_desc in tfs.h). With a journal the
+ * block cache holds every metadata change (file data never goes through
+ * it) and is no-steal, so nothing reaches its home location except
+ * through a commit:
+ *  1. take txn_lock exclusively, so no operation is half done, apply the
+ *     deferred frees, push the inode cache and bitmaps into the block
+ *     cache and take copies of all dirty blocks;
+ *  2. make the previous transaction's home writes durable (its journal
+ *     copy is about to be overwritten), write descriptor, images and
+ *     commit block to the journal with one vectored write and sync;
+ *  3. write the images home; the next commit (or unmount) syncs them.
+ * Commits are serialized by commit_lock and grouped: a caller that finds
+ * that a snapshot was taken after it asked just returns, since its changes
+ * are already committed. Operations call jnl_commit() themselves from
+ * txn_end() once JNL_COMMIT_DIRTY blocks are dirty, and flush, fsync and
+ * unmount commit too.
+ * A snapshot always goes out as one transaction, so it has to fit in the
+ * journal, and in the cache since none of it can leave before the commit.
+ * Every operation reserves credits in txn_begin_credits(), a generous
+ * bound on the blocks it dirties other than the bitmaps (those are kept
+ * out of txn_limit as a whole, the frees applied at commit can touch any
+ * of them). One that would take the dirty blocks, the dirty inodes and
+ * the credits of the operations still running past txn_limit commits
+ * first. Writes and writebacks go WRITE_CHUNK blocks per operation so
+ * their credits stay bounded too.
+ */
+#define JNL_COMMIT_DIRTY 64
+#define WRITE_CHUNK 256			/* blocks written (or written back) per operation */
+//an ext_add(): the nodes on the path plus one new node per level split
+#define EXT_ADD_CREDITS (2*EXT_DEPTH_MAX+1)
+//namespace operations: up to three directory blocks, two inode-table blocks and two ext_add()s
+#define TXN_CREDITS (8+2*EXT_ADD_CREDITS)
+
+//Credits for writing n blocks: per tree level, the nodes they can split and a few neighbours
+static inline int txn_data_credits(int n) {
+	return TXN_CREDITS + (EXT_DEPTH_MAX+1)*(3+4*(n+2)/(int)EXT_LEAF_MAX);
+}
+
+pthread_rwlock_t txn_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t jnl_snapshots = 0;
+static uint32_t jnl_seq = 0;
+static int jnl_home_pending = 0;
+static pthread_mutex_t credit_lock = PTHREAD_MUTEX_INITIALIZER;
+static int txn_limit = 0;			/* set at mount */
+static int txn_running = 0;			/* credits of the operations in a transaction */
+
+int jnl_commit();
+
+/*
+ * Start an operation that dirties at most credits blocks besides the
+ * bitmaps. Returns -1 if a commit to make room for it failed.
+ */
+int txn_begin_credits(int credits) {
+	if(!journal_on){
+		return 0;
+	}
+	for(;;){
+		pthread_mutex_lock(&credit_lock);
+		int used = txn_running + bio_dirty_count() + __atomic_load_n(&icache_ndirty, __ATOMIC_RELAXED);
+		if(used+credits <= txn_limit){
+			txn_running += credits;
+			pthread_mutex_unlock(&credit_lock);
+			break;
+		}
+		pthread_mutex_unlock(&credit_lock);
+		if(jnl_commit() < 0){
+			return -1;
+		}
+	}
+	pthread_rwlock_rdlock(&txn_lock);
+	return 0;
+}
+
+void txn_end_credits(int credits) {
+	if(journal_on){
+		pthread_rwlock_unlock(&txn_lock);
+		pthread_mutex_lock(&credit_lock);
+		txn_running -= credits;
+		pthread_mutex_unlock(&credit_lock);
+		if(bio_dirty_count() >= JNL_COMMIT_DIRTY){
+			jnl_commit();
+		}
+	}
+}
+
+int txn_begin() {
+	return txn_begin_credits(TXN_CREDITS);
+}
+
+void txn_end() {
+	txn_end_credits(TXN_CREDITS);
+}
+
+static uint32_t jnl_checksum(uint32_t h, const char *p, size_t len) {
+	size_t i;
+	for(i = 0; i < len; i++){
+		h = (h ^ (unsigned char)p[i]) * 16777619u;
+	}
+	return h;
+}
+
+static int jnl_capacity() {
+	int cap = s_block->j_blocks-2;
+	return cap < JNL_DESC_MAX ? cap : JNL_DESC_MAX;
+}
+
+//Write one transaction of n blocks to the journal, then home
+static int jnl_write(const int *blocks, const char *data, int n) {
+	int i, ret = 0;
+	if(jnl_home_pending && bio_sync() < 0){
+		return -1;
+	}
+	jnl_home_pending = 0;
+	struct jnl_desc *desc = calloc(1, BLOCK_SIZE);
+	struct jnl_commit *commit = calloc(1, BLOCK_SIZE);
+	desc->magic = JNL_DESC_MAGIC;
+	desc->seq = jnl_seq;
+	desc->count = n;
+	for(i = 0; i < n; i++){
+		desc->blocks[i] = blocks[i];
+	}
+	commit->magic = JNL_COMMIT_MAGIC;
+	commit->seq = jnl_seq;
+	commit->checksum = jnl_checksum(jnl_checksum(2166136261u, (char*)desc, BLOCK_SIZE), data, (size_t)n*BLOCK_SIZE);
+
+	int *jblocks = malloc(sizeof(int)*(n+2));
+	const void **bufs = malloc(sizeof(void*)*(n+2));
+	for(i = 0; i < n+2; i++){
+		jblocks[i] = s_block->j_start_blk + i;
+		bufs[i] = data+(size_t)(i-1)*BLOCK_SIZE;
+	}
+	bufs[0] = desc;
+	bufs[n+1] = commit;
+	if(bio_write_raw(jblocks, bufs, n+2) < 0 || bio_sync() < 0){
+		ret = -1;
+	}else{
+		//committed, now the home locations
+		for(i = 0; i < n; i++){
+			bufs[i] = data+(size_t)i*BLOCK_SIZE;
+		}
+		ret = bio_write_raw(blocks, bufs, n) < 0 ? -1 : 0;
+		jnl_home_pending = 1;
+	}
+	jnl_seq++;
+	free(bufs);
+	free(jblocks);
+	free(commit);
+	free(desc);
+	return ret;
+}
+
+/*
+ * Commit all metadata changed so far. Returns once it is durable in the
+ * journal (or -1 on an I/O error).
+ */
+int jnl_commit() {
+	if(!journal_on){
+		return 0;
+	}
+	uint64_t asked = __atomic_load_n(&jnl_snapshots, __ATOMIC_ACQUIRE);
+	pthread_mutex_lock(&commit_lock);
+	if(jnl_snapshots != asked){
+		pthread_mutex_unlock(&commit_lock);
+		return 0;
+	}
+	// Step 1: snapshot every dirty metadata block with no operation in flight
+	pthread_rwlock_wrlock(&txn_lock);
+	apply_pending_frees();
+	int ret = sync_inodes();
+	ret |= bitmap_sync(&ino_bmap);
+	ret |= bitmap_sync(&blk_bmap);
+	int *blocks;
+	char *data;
+	int n = bio_dirty_count();
+	if(n > jnl_capacity()){
+		//the credits should have prevented this; half a transaction would be worse than none
+		pthread_rwlock_unlock(&txn_lock);
+		TRACE(TRACE_INFO, TR_JNL_COMMIT, jnl_seq, n, -1);
+		pthread_mutex_unlock(&commit_lock);
+		return -1;
+	}
+	n = bio_take_dirty(&blocks, &data);
+	__atomic_store_n(&jnl_snapshots, jnl_snapshots+1, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&txn_lock);
+
+	// Step 2: journal it as a single transaction and write it home
+	if(n > 0){
+		ret |= jnl_write(blocks, data, n);
+	}
+	bio_unpin();
+	free(blocks);
+	free(data);
+	TRACE(TRACE_INFO, TR_JNL_COMMIT, jnl_seq, n, ret);
+	pthread_mutex_unlock(&commit_lock);
+	return ret < 0 ? -1 : 0;
+}
+
+//Forget the transaction in the journal (its home writes are durable)
+static int jnl_clear() {
+	int block = s_block->j_start_blk;
+	char *zero = calloc(1, BLOCK_SIZE);
+	const void *buf = zero;
+	int ret = bio_write_raw(&block, &buf, 1) < 0 || bio_sync() < 0 ? -1 : 0;
+	free(zero);
+	return ret;
+}
+
+/*
+ * Mount time: if the journal holds a complete transaction, write it home.
+ * Must run before anything else reads metadata.
+ */
+static int jnl_replay() {
+	struct jnl_desc *desc = malloc(BLOCK_SIZE);
+	int i, n = 0, block = s_block->j_start_blk;
+	void *buf = desc;
+	jnl_seq = (uint32_t)time(NULL);
+	if(bio_readv(&block, &buf, 1) < 0 || desc->magic != JNL_DESC_MAGIC || desc->count > jnl_capacity()){
+		free(desc);
+		return 0;
+	}
+	n = desc->count;
+	char *data = malloc((size_t)BLOCK_SIZE*(n+1));
+	int *blocks = malloc(sizeof(int)*(n+1));
+	void **bufs = malloc(sizeof(void*)*(n+1));
+	for(i = 0; i < n+1; i++){
+		blocks[i] = s_block->j_start_blk+1+i;
+		bufs[i] = data+(size_t)i*BLOCK_SIZE;
+	}
+	struct jnl_commit *commit = (struct jnl_commit*)(data+(size_t)n*BLOCK_SIZE);
+	if(bio_readv(blocks, bufs, n+1) < 0 || commit->magic != JNL_COMMIT_MAGIC || commit->seq != desc->seq ||
+			commit->checksum != jnl_checksum(jnl_checksum(2166136261u, (char*)desc, BLOCK_SIZE), data, (size_t)n*BLOCK_SIZE)){
+		//torn or stale: the transaction never committed
+		n = 0;
+	}else{
+		for(i = 0; i < n; i++){
+			blocks[i] = desc->blocks[i];
+		}
+		if(bio_write_raw(blocks, (const void *const *)bufs, n) < 0 || bio_sync() < 0){
+			n = -1;
+		}else{
+			jnl_clear();
+		}
+		TRACE(TRACE_INFO, TR_JNL_REPLAY, desc->seq, n, 0);
+		jnl_seq = desc->seq+1;
+	}
+	free(bufs);
+	free(blocks);
+	free(data);
+	free(desc);
+	return n;
+}
+
+int readi(uint32_t ino, struct inode *inode) {
+	struct cached_inode *ci = iget(ino);
+	if(ci == NULL){
+		return -1;
+	}
+	pthread_mutex_lock(&icache_lock);
+	memcpy(inode, &ci->inode, sizeof(struct inode));
+	pthread_mutex_unlock(&icache_lock);
+	iput(ci);
+	return 0;
+}
+
+int writei(uint32_t ino, struct inode *inode) {
+	//no need to read the old copy in on a miss, the whole inode gets replaced
+	pthread_mutex_lock(&icache_lock);
+	struct cached_inode *ci = icache_lookup(ino);
+	if(ci == NULL){
+		ci = icache_alloc(ino);
+		if(ci == NULL){
+			pthread_mutex_unlock(&icache_lock);
+			return -1;
+		}
+	}
+	memcpy(&ci->inode, inode, sizeof(struct inode));
+	ci->inode.ino = ino;
+	if(!ci->dirty){
+		__atomic_store_n(&icache_ndirty, icache_ndirty+1, __ATOMIC_RELAXED);
+		ci->dirty = 1;
+	}
+	pthread_mutex_unlock(&icache_lock);
+	return 0;
+}
+
+
+/*
+ * block mapping
+ *
+ * New inodes map their data with extents (see struct extent in tfs.h);
+ * inodes written before extents existed still use direct_ptr[] and are
+ * converted the first time they need a new block. Small files have no
+ * blocks at all (INODE_FL_INLINE, see inline_spill()).
+ */
+static inline int data_block(uint32_t blkno) {
+	return s_block->d_start_blk + blkno;
+}
+
+void ext_init(struct inode *inode) {
+	memset(&inode->eh, 0, sizeof(inode->eh) + sizeof(inode->extents));
+	inode->eh.magic = EXT_MAGIC;
+	inode->flags |= INODE_FL_EXTENTS;
+}
+
+//index of the last extent in ext[0..n) starting at or before lblk, -1 if none
+static int ext_search(struct extent *ext, int n, uint32_t lblk) {
+	int lo = 0, hi = n-1, ret = -1;
+	while(lo <= hi){
+		int mid = (lo+hi)/2;
+		if(ext[mid].lblk <= lblk){
+			ret = mid;
+			lo = mid+1;
+		}else{
+			hi = mid-1;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Map logical block lblk of inode to a data block number (relative to
+ * d_start_blk), or -1 for a hole. If len isn't NULL it gets how many blocks
+ * from lblk on are mapped contiguously, or for a hole how long the hole is.
+ */
+int bmap(struct inode *inode, uint32_t lblk, uint32_t *len) {
+	uint32_t next = UINT32_MAX;
+	if(inode->flags & INODE_FL_INLINE){
+		if(len){
+			*len = next-lblk;
+		}
+		return -1;
+	}
+	if(!(inode->flags & INODE_FL_EXTENTS)){
+		if(len){
+			*len = 1;
+		}
+		return lblk < 16 && inode->direct_ptr[lblk] >= 0 ? inode->direct_ptr[lblk] : -1;
+	}
+	struct extent *ext = inode->extents;
+	int i, depth = inode->eh.depth, n = inode->eh.entries, ret = -1;
+	struct extent_leaf *leaf = NULL;
+	if(depth > 0){
+		leaf = malloc(BLOCK_SIZE);
+	}
+	for(; depth > 0; depth--){
+		i = ext_search(ext, n, lblk);
+		if(i < 0){
+			i = 0;
+		}
+		if(i+1 < n){
+			next = ext[i+1].lblk;
+		}
+		bio_read(data_block(ext[i].start), leaf);
+		ext = leaf->extents;
+		n = leaf->hdr.entries;
+	}
+	i = ext_search(ext, n, lblk);
+	if(i >= 0 && lblk < ext[i].lblk + ext[i].len){
+		ret = ext[i].start + (lblk - ext[i].lblk);
+		next = ext[i].lblk + ext[i].len;
+	}else if(i+1 < n){
+		next = ext[i+1].lblk;
+	}
+	if(len){
+		*len = next - lblk;
+	}
+	free(leaf);
+	return ret;
+}
+
+/*
+ * Add lblk..lblk+len-1 -> start..start+len-1 (not mapped yet) to the sorted
+ * extents ext[0..*n), growing the preceding extent when the two are
+ * contiguous. Returns -1 if a new entry is needed but there are already max.
+ */
+static int ext_insert(struct extent *ext, uint16_t *n, int max, uint32_t lblk, uint32_t start, uint32_t len) {
+	int i = ext_search(ext, *n, lblk);
+	if(i >= 0 && ext[i].lblk+ext[i].len == lblk && ext[i].start+ext[i].len == start){
+		ext[i].len += len;
+		return 0;
+	}
+	if(*n >= max){
+		return -1;
+	}
+	memmove(&ext[i+2], &ext[i+1], sizeof(struct extent)*(*n-i-1));
+	ext[i+1].lblk = lblk;
+	ext[i+1].start = start;
+	ext[i+1].len = len;
+	(*n)++;
+	return 0;
+}
+
+static void ext_leaf_init(struct extent_leaf *leaf) {
+	memset(leaf, 0, BLOCK_SIZE);
+	leaf->hdr.magic = EXT_MAGIC;
+}
+
+//Whether e can go into the node without splitting it
+static int ext_fits(struct extent_header *hdr, struct extent *ext, int max, const struct extent *e) {
+	if(hdr->entries < max){
+		return 1;
+	}
+	int i = ext_search(ext, hdr->entries, e->lblk);
+	return hdr->depth == 0 && i >= 0 && ext[i].lblk+ext[i].len == e->lblk && ext[i].start+ext[i].len == e->start;
+}
+
+//Put e (an extent in a leaf, an index entry above) into a node, -1 if it is full
+static int ext_node_insert(struct extent_header *hdr, struct extent *ext, int max, const struct extent *e) {
+	if(hdr->depth == 0){
+		return ext_insert(ext, &hdr->entries, max, e->lblk, e->start, e->len);
+	}
+	if(hdr->entries >= max){
+		return -1;
+	}
+	int i = ext_search(ext, hdr->entries, e->lblk);
+	memmove(&ext[i+2], &ext[i+1], sizeof(struct extent)*(hdr->entries-i-1));
+	ext[i+1] = *e;
+	hdr->entries++;
+	return 0;
+}
+
+/*
+ * Add an extent to inode's tree. The path from the root to the leaf for
+ * lblk is read first, to count the full nodes the insert would have to
+ * split, and every block those splits need is allocated before anything
+ * changes, so running out of space leaves the tree as it was. Then the
+ * extent goes into the leaf; a full node moves its upper half to a new
+ * block (appends get a fresh one) and the new block's index entry goes
+ * one level up, and a full root moves its entries down to a new block and
+ * becomes an index over it, which adds a level.
+ */
+static int ext_add(struct inode *inode, uint32_t lblk, uint32_t start, uint32_t len) {
+	struct extent_leaf *node[EXT_DEPTH_MAX];
+	int nodeblk[EXT_DEPTH_MAX], spare[EXT_DEPTH_MAX+1];
+	int depth = inode->eh.depth, level, i, need = 0, nspare = 0, top, ret = 0;
+	struct extent e = { .lblk = lblk, .start = start, .len = len };
+	if(depth > EXT_DEPTH_MAX){
+		return -1;
+	}
+
+	// Step 1: read the path down to the leaf; level 0 is the root, level depth the leaf
+	struct extent_header *hdr = &inode->eh;
+	struct extent *ext = inode->extents;
+	for(level = 1; level <= depth; level++){
+		i = ext_search(ext, hdr->entries, lblk);
+		nodeblk[level-1] = ext[i < 0 ? 0 : i].start;
+		node[level-1] = malloc(BLOCK_SIZE);
+		bio_read(data_block(nodeblk[level-1]), node[level-1]);
+		hdr = &node[level-1]->hdr;
+		ext = node[level-1]->extents;
+	}
+
+	// Step 2: one new block for every full node from the leaf up (and for a full root)
+	for(level = depth; level >= 0; level--){
+		hdr = level > 0 ? &node[level-1]->hdr : &inode->eh;
+		ext = level > 0 ? node[level-1]->extents : inode->extents;
+		if(ext_fits(hdr, ext, level > 0 ? EXT_LEAF_MAX : EXT_ROOT_MAX, &e)){
+			break;
+		}
+		need++;
+	}
+	if(level < 0 && depth == EXT_DEPTH_MAX){
+		ret = -1;
+		goto out;
+	}
+	for(i = 0; i < need; i++){
+		int got;
+		if((spare[i] = alloc_blkrun(ino_group(inode->ino), -1, 1, &got)) < 0){
+			while(--i >= 0){
+				release_blkno(spare[i]);
+			}
+			ret = -1;
+			goto out;
+		}
+	}
+
+	// Step 3: insert, splitting on the way up
+	for(top = depth; ; top--){
+		hdr = top > 0 ? &node[top-1]->hdr : &inode->eh;
+		ext = top > 0 ? node[top-1]->extents : inode->extents;
+		if(ext_node_insert(hdr, ext, top > 0 ? EXT_LEAF_MAX : EXT_ROOT_MAX, &e) == 0){
+			break;
+		}
+		struct extent_leaf *right = malloc(BLOCK_SIZE);
+		int blk = spare[nspare++];
+		ext_leaf_init(right);
+		right->hdr.depth = hdr->depth;
+		if(top == 0){
+			// the root is full: everything moves down a level
+			right->hdr.entries = hdr->entries;
+			memcpy(right->extents, ext, sizeof(struct extent)*hdr->entries);
+			ext_node_insert(&right->hdr, right->extents, EXT_LEAF_MAX, &e);
+			bio_write(data_block(blk), right);
+			free(right);
+			inode->eh.depth++;
+			inode->eh.entries = 1;
+			ext[0].lblk = 0;
+			ext[0].start = blk;
+			ext[0].len = 0;
+			break;
+		}
+		int n = hdr->entries;
+		int half = e.lblk > ext[n-1].lblk ? n : n/2;
+		right->hdr.entries = n-half;
+		memcpy(right->extents, &ext[half], sizeof(struct extent)*(n-half));
+		hdr->entries = half;
+		if(half == n || e.lblk >= right->extents[0].lblk){
+			ext_node_insert(&right->hdr, right->extents, EXT_LEAF_MAX, &e);
+		}else{
+			ext_node_insert(hdr, ext, EXT_LEAF_MAX, &e);
+		}
+		bio_write(data_block(blk), right);
+		e.lblk = right->extents[0].lblk;
+		e.start = blk;
+		e.len = 0;
+		free(right);
+	}
+	// Step 4: write back the nodes that changed
+	for(level = top > 0 ? top : 1; level <= depth; level++){
+		bio_write(data_block(nodeblk[level-1]), node[level-1]);
+	}
+out:
+	for(level = 1; level <= depth; level++){
+		free(node[level-1]);
+	}
+	return ret;
+}
+
+//Switch an old direct_ptr[] inode over to extents
+static int ext_convert(struct inode *inode) {
+	int ptrs[16], i;
+	memcpy(ptrs, inode->direct_ptr, sizeof(ptrs));
+	ext_init(inode);
+	for(i = 0; i < 16; i++){
+		if(ptrs[i] >= 0 && ext_add(inode, i, ptrs[i], 1) < 0){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Make sure logical blocks lblk..lblk+count-1 of inode are mapped. Each
+ * hole gets contiguous runs of blocks, placed right after the block mapped
+ * before it when possible, from rsv when the caller has a reservation
+ * (NULL if not). The caller writes the inode. Returns how many blocks had
+ * to be allocated, or -1. Inline files have to be spilled first.
+ */
+int bmap_alloc(struct inode *inode, uint32_t lblk, uint32_t count, struct blk_rsv *rsv) {
+	if(inode->flags & INODE_FL_INLINE){
+		return -1;
+	}
+	if(!(inode->flags & INODE_FL_EXTENTS) && ext_convert(inode) < 0){
+		return -1;
+	}
+	uint32_t end = lblk+count, run;
+	int allocated = 0;
+	while(lblk < end){
+		if(bmap(inode, lblk, &run) >= 0){
+			lblk += run;
+			continue;
+		}
+		int goal = -1, got;
+		if(lblk > 0 && (goal = bmap(inode, lblk-1, NULL)) >= 0){
+			goal++;
+		}
+		int want = run < end-lblk ? run : end-lblk;
+		//a file's first blocks go in its inode's group, the rest follow on
+		int g = goal >= 0 ? blk_group(goal) : ino_group(inode->ino);
+		int start = rsv != NULL ? rsv_alloc(rsv, g, goal, want, &got) : alloc_blkrun(g, goal, want, &got);
+		if(start < 0){
+			return -1;
+		}
+		if(ext_add(inode, lblk, start, got) < 0){
+			release_blkrun(start, got);
+			return -1;
+		}
+		lblk += got;
+		allocated += got;
+	}
+	return allocated;
+}
+
+//Release the data blocks a node maps and, below the root, the nodes under it
+static void ext_free_node(struct extent_header *hdr, struct extent *ext) {
+	int i;
+	if(hdr->depth == 0){
+		for(i = 0; i < hdr->entries; i++){
+			release_blkrun(ext[i].start, ext[i].len);
+		}
+		return;
+	}
+	struct extent_leaf *child = malloc(BLOCK_SIZE);
+	for(i = 0; i < hdr->entries; i++){
+		bio_read(data_block(ext[i].start), child);
+		ext_free_node(&child->hdr, child->extents);
+		release_blkno(ext[i].start);
+	}
+	free(child);
+}
+
+//Release every data block (and extent tree block) of inode
+void bmap_free(struct inode *inode) {
+	int i;
+	if(inode->flags & INODE_FL_INLINE){
+		return;
+	}
+	if(!(inode->flags & INODE_FL_EXTENTS)){
+		for(i = 0; i < 16; i++){
+			if(inode->direct_ptr[i] >= 0){
+				release_blkno(inode->direct_ptr[i]);
+			}
+			inode->direct_ptr[i] = -1;
+		}
+		return;
+	}
+	ext_free_node(&inode->eh, inode->extents);
+	ext_init(inode);
+}
+
+/*
+ * fsync support. Every file inode remembers which data blocks were written
+ * since its last fsync (sync_blocks, under the inode lock) and whether its
+ * size or block mapping changed (meta_dirty), which is what decides if
+ * fdatasync has to write metadata too. If an inode is evicted with blocks
+ * still listed, sync_lost makes the next fsync sync the whole disk file.
+ */
+static int cmp_blockno(const void *a, const void *b) {
+	int x = *(const int*)a, y = *(const int*)b;
+	return (x > y) - (x < y);
+}
+
+//Note that blocks[0..n) of ci (device block numbers) were written
+static void sync_track(struct cached_inode *ci, const int *blocks, int n) {
+	int i, j;
+	if(ci->nsync+n > ci->sync_cap && ci->nsync > 0){
+		//rewrites of the same blocks pile up, squeeze them out first
+		qsort(ci->sync_blocks, ci->nsync, sizeof(int), cmp_blockno);
+		for(i = 1, j = 1; i < ci->nsync; i++){
+			if(ci->sync_blocks[i] != ci->sync_blocks[j-1]){
+				ci->sync_blocks[j++] = ci->sync_blocks[i];
+			}
+		}
+		ci->nsync = j;
+	}
+	if(ci->nsync+n > ci->sync_cap){
+		ci->sync_cap = ci->sync_cap ? ci->sync_cap*2 : 64;
+		if(ci->sync_cap < ci->nsync+n){
+			ci->sync_cap = ci->nsync+n;
+		}
+		ci->sync_blocks = realloc(ci->sync_blocks, sizeof(int)*ci->sync_cap);
+	}
+	memcpy(&ci->sync_blocks[ci->nsync], blocks, sizeof(int)*n);
+	ci->nsync += n;
+}
+
+//Append the device blocks of the tree nodes under a node to *blocks (*cap entries)
+static void ext_node_blocks(struct extent_header *hdr, struct extent *ext, int **blocks, int *n, int *cap) {
+	int i;
+	if(hdr->depth == 0){
+		return;
+	}
+	struct extent_leaf *child = malloc(BLOCK_SIZE);
+	for(i = 0; i < hdr->entries; i++){
+		if(*n == *cap){
+			*cap *= 2;
+			*blocks = realloc(*blocks, sizeof(int)*(*cap));
+		}
+		(*blocks)[(*n)++] = data_block(ext[i].start);
+		bio_read(data_block(ext[i].start), child);
+		ext_node_blocks(&child->hdr, child->extents, blocks, n, cap);
+	}
+	free(child);
+}
+
+/*
+ * Device blocks holding inode's metadata: its inode-table block, its
+ * extent tree blocks and the two bitmaps (all of their blocks; the clean
+ * ones cost next to nothing to sync). Returns a malloc'ed array, *n set to
+ * its length.
+ */
+static int *inode_meta_blocks(struct inode *inode, int *n) {
+	int i, cap = EXT_ROOT_MAX+1+ino_bmap.nblocks+blk_bmap.nblocks;
+	int *blocks = malloc(sizeof(int)*cap);
+	*n = 0;
+	for(i = 0; i < ino_bmap.nblocks; i++){
+		blocks[(*n)++] = ino_bmap.blk+i;
+	}
+	for(i = 0; i < blk_bmap.nblocks; i++){
+		blocks[(*n)++] = blk_bmap.blk+i;
+	}
+	blocks[(*n)++] = inode_block(inode->ino);
+	if(inode->flags & INODE_FL_EXTENTS){
+		ext_node_blocks(&inode->eh, inode->extents, &blocks, n, &cap);
+	}
+	return blocks;
+}
+
+/*
+ * Delayed allocation (-o delalloc). tfs_write only copies data into
+ * per-inode dirty pages and moves the size; no blocks are allocated and
+ * nothing is written. inode_writeback() later maps every run of
+ * consecutive dirty pages with a single bmap_alloc, so the whole run is
+ * placed contiguously, and writes them all with one bio_writev. That
+ * happens on flush, release and unmount, and for the writer's own inode
+ * once more than DELALLOC_MAX_PAGES are dirty in total. Dirty pages are
+ * guarded by the inode lock and pin the inode in the cache.
+ */
+#define DELALLOC_MAX_PAGES 4096
 
-#include <fuse.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <errno.h>
-#include <sys/time.h>
-#include <libgen.h>
-#include <limits.h>
-#include <pthread.h>
-#include "block.h"
-#include "tfs.h"
+struct dirty_page {
+	uint32_t	lblk;
+	char		data[BLOCK_SIZE];
+};
 
-#define _DIRECTORY_ 0
-#define _FILE_ 1
+int delalloc = 0;
+static int delalloc_pages = 0;
+
+//index of the first dirty page of ci at or after lblk
+static int dirty_search(struct cached_inode *ci, uint32_t lblk) {
+	int lo = 0, hi = ci->ndirty;
+	while(lo < hi){
+		int mid = (lo+hi)/2;
+		if(ci->dpages[mid]->lblk < lblk){
+			lo = mid+1;
+		}else{
+			hi = mid;
+		}
+	}
+	return lo;
+}
 
-char diskfile_path[PATH_MAX];
+//Dirty page for lblk, creating it (with *created set) if there isn't one
+static struct dirty_page *dirty_get(struct cached_inode *ci, uint32_t lblk, int *created) {
+	int i = dirty_search(ci, lblk);
+	*created = 0;
+	if(i < ci->ndirty && ci->dpages[i]->lblk == lblk){
+		return ci->dpages[i];
+	}
+	if(ci->ndirty == ci->dcap){
+		ci->dcap = ci->dcap ? ci->dcap*2 : 16;
+		ci->dpages = realloc(ci->dpages, sizeof(struct dirty_page*)*ci->dcap);
+	}
+	struct dirty_page *dp = malloc(sizeof(struct dirty_page));
+	dp->lblk = lblk;
+	memmove(&ci->dpages[i+1], &ci->dpages[i], sizeof(struct dirty_page*)*(ci->ndirty-i));
+	ci->dpages[i] = dp;
+	ci->ndirty++;
+	__atomic_add_fetch(&delalloc_pages, 1, __ATOMIC_RELAXED);
+	*created = 1;
+	return dp;
+}
 
-// Declare your in-memory data structures here
-int disk_file = -1;
-struct superblock* s_block;
-int total_blocks_used = 0;
-pthread_mutex_t lock;
-/* 
- * Get available inode number from bitmap
+//Throw away the first n of ci's dirty pages
+static void dirty_drop(struct cached_inode *ci, int n) {
+	int i;
+	for(i = 0; i < n; i++){
+		free(ci->dpages[i]);
+	}
+	__atomic_sub_fetch(&delalloc_pages, n, __ATOMIC_RELAXED);
+	ci->ndirty -= n;
+	memmove(ci->dpages, ci->dpages+n, sizeof(struct dirty_page*)*ci->ndirty);
+	if(ci->ndirty == 0){
+		free(ci->dpages);
+		ci->dpages = NULL;
+		ci->dcap = 0;
+	}
+}
+
+//Buffer a write in ci's dirty pages. The caller updates the size.
+static int dirty_write(struct cached_inode *ci, struct inode *inode, const char *buffer, size_t size, off_t offset) {
+	uint32_t lblk, first = offset/BLOCK_SIZE, last = (offset+size-1)/BLOCK_SIZE;
+	for(lblk = first; lblk <= last; lblk++){
+		off_t start = (off_t)lblk*BLOCK_SIZE;
+		off_t from = start > offset ? start : offset;
+		off_t to = start+BLOCK_SIZE < offset+(off_t)size ? start+BLOCK_SIZE : offset+(off_t)size;
+		int created;
+		struct dirty_page *dp = dirty_get(ci, lblk, &created);
+		if(created && to-from < BLOCK_SIZE){
+			//a partial page starts as what is on disk, zeroes past the end of file
+			int blkno = bmap(inode, lblk, NULL);
+			size_t valid = inode->size > start ? inode->size-start : 0;
+			if(blkno < 0){
+				valid = 0;
+			}else{
+				int block = data_block(blkno);
+				void *buf = dp->data;
+				bio_readv(&block, &buf, 1);
+			}
+			if(valid < BLOCK_SIZE){
+				memset(dp->data+valid, 0, BLOCK_SIZE-valid);
+			}
+		}
+		memcpy(dp->data+(from-start), buffer+(from-offset), to-from);
+	}
+	return size;
+}
+
+//Copy ci's dirty pages over whatever was read from disk for [offset, offset+size)
+static void dirty_overlay(struct cached_inode *ci, char *buffer, size_t size, off_t offset) {
+	int i = dirty_search(ci, offset/BLOCK_SIZE);
+	for(; i < ci->ndirty; i++){
+		off_t start = (off_t)ci->dpages[i]->lblk*BLOCK_SIZE;
+		if(start >= offset+(off_t)size){
+			break;
+		}
+		off_t from = start > offset ? start : offset;
+		off_t to = start+BLOCK_SIZE < offset+(off_t)size ? start+BLOCK_SIZE : offset+(off_t)size;
+		memcpy(buffer+(from-offset), ci->dpages[i]->data+(from-start), to-from);
+	}
+}
+
+/*
+ * Allocate blocks for (at most max of) ci's dirty pages and write them
+ * out. The caller holds ci's lock exclusively.
  */
-int get_avail_ino() {
-
-	// Step 1: Read inode bitmap from disk
-	bitmap_t inode_bitmap = malloc(sizeof(char)*MAX_INUM/8);
-	void* buffer = malloc(BLOCK_SIZE);
-	if(s_block != NULL){
-		bio_read(s_block->i_bitmap_blk, buffer);
-		memcpy(inode_bitmap, buffer, s_block->max_inum/8);
-	}else{
-		//superblock not allocated somehow
-		free(buffer);
-		free(inode_bitmap);
-		return -1;
-	}	
-	// Step 2: Traverse inode bitmap to find an available slot
-	int i, pos = -1;
-	for(i = 0; i < s_block->max_inum; i++){
-		if(get_bitmap(inode_bitmap, i)==0){
-			pos = i;
+static int inode_writeback(struct cached_inode *ci, int max) {
+	if(ci->ndirty == 0){
+		return 0;
+	}
+	struct inode inode;
+	readi(ci->inode.ino, &inode);
+	int i, j, n = ci->ndirty < max ? ci->ndirty : max, ret = 0;
+	for(i = 0; i < n; i = j){
+		for(j = i+1; j < n && ci->dpages[j]->lblk == ci->dpages[j-1]->lblk+1; j++);
+		int allocated = bmap_alloc(&inode, ci->dpages[i]->lblk, j-i, &ci->rsv);
+		if(allocated != 0){
+			ci->meta_dirty = 1;
+		}
+		if(allocated < 0){
+			ret = -ENOSPC;
 			break;
+		}
+	}
+	if(ret == 0){
+		int *blocks = malloc(sizeof(int)*n);
+		const void **bufs = malloc(sizeof(void*)*n);
+		for(i = 0; i < n; i++){
+			blocks[i] = data_block(bmap(&inode, ci->dpages[i]->lblk, NULL));
+			bufs[i] = ci->dpages[i]->data;
+		}
+		if(bio_writev(blocks, bufs, n) < 0){
+			ret = -EIO;
 		}else{
-			printf("this was set to 1: %d\n", i);
-			
+			dirty_drop(ci, n);
 		}
+		sync_track(ci, blocks, n);
+		free(bufs);
+		free(blocks);
 	}
-	if(pos == -1){
-		free(buffer);
-		free(inode_bitmap);	//no free blocks
-		return -1;
+	//blocks that used to be holes have moved from the dirty pages to disk
+	ci->data_gen++;
+	writei(inode.ino, &inode);
+	TRACE(TRACE_DEBUG, TR_WRITEBACK, inode.ino, n, ret);
+	return ret;
+}
+
+//Write back all of file ino's dirty pages, WRITE_CHUNK of them per transaction
+static int writeback_ino(uint32_t ino) {
+	int ret = 0, left = 1, credits = txn_data_credits(WRITE_CHUNK);
+	while(ret == 0 && left){
+		if(txn_begin_credits(credits) < 0){
+			return -EIO;
+		}
+		struct cached_inode *ci = ilock(ino, 1);
+		if(ci == NULL){
+			txn_end_credits(credits);
+			return -EIO;
+		}
+		ret = inode_writeback(ci, WRITE_CHUNK);
+		left = ci->ndirty > 0;
+		iunlock(ci);
+		txn_end_credits(credits);
 	}
-	// Step 3: Update inode bitmap and write to disk 
-	set_bitmap(inode_bitmap, pos);
-	memcpy(buffer, inode_bitmap, sizeof(char)*MAX_INUM/8);
-	bio_write(s_block->i_bitmap_blk, buffer);
-	free(buffer);
-	free(inode_bitmap);
-	total_blocks_used++;
-	return pos;
+	return ret;
 }
 
-/* 
- * Get available data block number from bitmap
- */
-int get_avail_blkno() {
-	//almost exact same as previous function. refer to its comments to understand
-
-	// Step 1: Read inode bitmap from disk
-	bitmap_t data_bitmap = malloc(sizeof(char)*MAX_DNUM/8);
-	void* buffer = malloc(BLOCK_SIZE);
-	if(s_block != NULL){
-		bio_read(s_block->d_bitmap_blk, buffer);
-		memcpy(data_bitmap, buffer, s_block->max_dnum/8);
-	}else{
-		//something wrong with read
-		free(buffer);
-		free(data_bitmap);
-		return -1;
-	}	
-	// Step 2: Traverse inode bitmap to find an available slot
-	int i, pos = -1;
-	for(i = 0; i < MAX_DNUM; i++){
-		if(get_bitmap(data_bitmap, i)==0){
-			pos = i;
-			break;
+//Write back every inode that has dirty pages
+static int writeback_all() {
+	int i, n = 0, ret = 0;
+	pthread_mutex_lock(&icache_lock);
+	struct cached_inode *ci;
+	for(ci = icache_lru.next; ci != &icache_lru; ci = ci->next){
+		n += ci->ndirty > 0;
+	}
+	uint32_t *inos = malloc(sizeof(uint32_t)*(n+1));
+	n = 0;
+	for(ci = icache_lru.next; ci != &icache_lru; ci = ci->next){
+		if(ci->ndirty > 0){
+			inos[n++] = ci->inode.ino;
 		}
 	}
-	if(pos == -1){
-		//no free blocks
-		free(buffer);
-		free(data_bitmap);
-		return -1;
+	pthread_mutex_unlock(&icache_lock);
+	for(i = 0; i < n; i++){
+		ret |= writeback_ino(inos[i]);
 	}
-	// Step 3: Update inode bitmap and write to disk 
-	set_bitmap(data_bitmap, pos);
-	memcpy(buffer, data_bitmap, sizeof(char)*MAX_DNUM/8);
-	bio_write(s_block->d_bitmap_blk,buffer);
-	free(buffer);
-	free(data_bitmap);
-	total_blocks_used++;
-	return pos;
+	free(inos);
+	return ret;
 }
 
-/* 
- * inode operations
- */
-int readi(uint16_t ino, struct inode *inode) {
 
-  // Step 1: Get the inode's on-disk block number
-  int inodes_per_block = BLOCK_SIZE/sizeof(struct inode);
-  int block_no = ino/inodes_per_block; //int division :)
+#define DCACHE_SIZE 4096		/* dentries kept before the least recently used is dropped */
+#define DCACHE_BUCKETS 8192
+#define DCACHE_MISS -1			/* dcache_lookup(): nothing cached for the name */
+#define DCACHE_NEG -2			/* dcache_lookup(): name is known not to exist */
 
-  // Step 2: Get offset of the inode in the inode on-disk block
-  int offset = ino%inodes_per_block;
-  // Step 3: Read the block from disk and then copy into inode structure
+/*
+ * Dentry cache: (parent directory ino, name) -> ino, so get_node_by_path()
+ * can resolve paths without going to the directory blocks. A negative
+ * entry (ino == -1) records that the name does not exist in the parent.
+ * dir_add()/dir_remove() keep it in sync; rmdir drops a dead directory's
+ * children with dcache_forget_dir().
+ */
+struct dentry {
+	uint32_t		parent;
+	int				ino;			/* -1 for a negative entry */
+	uint16_t		len;
+	char			name[sizeof(((struct dirent*)0)->name)];
+	struct dentry	*hnext;			/* hash chain */
+	struct dentry	*prev, *next;	/* LRU list, most recently used first */
+};
 
-  char* buffer = malloc(BLOCK_SIZE);
-  //since inode blocks dont start at 0, need to get i_start_blk from the superblock and add that to the calculated block_no
-  bio_read(block_no+s_block->i_start_blk, (void*)buffer);
+struct dentry *dcache_hash[DCACHE_BUCKETS];
+struct dentry dcache_lru = { .prev = &dcache_lru, .next = &dcache_lru };
+int dcache_count = 0;
+pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned dcache_bucket(uint32_t parent, const char *name, size_t len) {
+	unsigned h = 2166136261u ^ parent;
+	size_t i;
+	for(i = 0; i < len; i++){
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h%DCACHE_BUCKETS;
+}
 
-  printf("block_no: %d  offset: %d  s_block->i_start_blk: %d\n", block_no, offset, s_block->i_start_blk);
+static struct dentry **dcache_find(uint32_t parent, const char *name, size_t len) {
+	struct dentry **pp = &dcache_hash[dcache_bucket(parent, name, len)];
+	while(*pp != NULL && !((*pp)->parent == parent && (*pp)->len == len && memcmp((*pp)->name, name, len) == 0)){
+		pp = &(*pp)->hnext;
+	}
+	return pp;
+}
 
+static void dcache_unlink(struct dentry **pp) {
+	struct dentry *d = *pp;
+	*pp = d->hnext;
+	d->prev->next = d->next;
+	d->next->prev = d->prev;
+	dcache_count--;
+}
 
-  //copy inode from within the block
-  memcpy((void*)inode, (void*) &buffer[sizeof(struct inode)*offset], sizeof(struct inode));
-  printf("SIZE for inode %d: %d\n", inode->ino,inode->size);
-  free(buffer);
-  return 0;
+static void dcache_lru_front(struct dentry *d) {
+	d->next = dcache_lru.next;
+	d->prev = &dcache_lru;
+	dcache_lru.next->prev = d;
+	dcache_lru.next = d;
 }
 
-int writei(uint16_t ino, struct inode *inode) {
+//Returns the cached ino for name in parent, DCACHE_NEG or DCACHE_MISS
+int dcache_lookup(uint32_t parent, const char *name, size_t len) {
+	pthread_mutex_lock(&dcache_lock);
+	struct dentry *d = *dcache_find(parent, name, len);
+	int ret = DCACHE_MISS;
+	if(d != NULL){
+		d->prev->next = d->next;
+		d->next->prev = d->prev;
+		dcache_lru_front(d);
+		ret = d->ino < 0 ? DCACHE_NEG : d->ino;
+	}
+	pthread_mutex_unlock(&dcache_lock);
+	return ret;
+}
 
-//similar to readi, but need to read block i_start_blk + blockno into mem, copy inode into correct offset, and then write the block back into memory.
+//Add or update the entry for name in parent; ino -1 makes it negative
+void dcache_insert(uint32_t parent, const char *name, size_t len, int ino) {
+	if(len >= sizeof(((struct dentry*)0)->name)){
+		return;
+	}
+	pthread_mutex_lock(&dcache_lock);
+	struct dentry **pp = dcache_find(parent, name, len);
+	struct dentry *d = *pp;
+	if(d != NULL){
+		dcache_unlink(pp);
+	}else if(dcache_count >= DCACHE_SIZE){
+		d = dcache_lru.prev;
+		dcache_unlink(dcache_find(d->parent, d->name, d->len));
+	}else{
+		d = malloc(sizeof(struct dentry));
+		if(d == NULL){
+			pthread_mutex_unlock(&dcache_lock);
+			return;
+		}
+	}
+	d->parent = parent;
+	d->ino = ino;
+	d->len = len;
+	memcpy(d->name, name, len);
+	unsigned h = dcache_bucket(parent, name, len);
+	d->hnext = dcache_hash[h];
+	dcache_hash[h] = d;
+	dcache_lru_front(d);
+	dcache_count++;
+	pthread_mutex_unlock(&dcache_lock);
+}
 
+//Drop every entry (positive or negative) under directory ino
+void dcache_forget_dir(uint32_t ino) {
+	pthread_mutex_lock(&dcache_lock);
+	struct dentry *d = dcache_lru.next;
+	while(d != &dcache_lru){
+		struct dentry *next = d->next;
+		if(d->parent == ino){
+			dcache_unlink(dcache_find(d->parent, d->name, d->len));
+			free(d);
+		}
+		d = next;
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
 
-  // Step 1: Get the inode's on-disk block number
-  int inodes_per_block = BLOCK_SIZE/sizeof(struct inode);
-  int block_no = ino/inodes_per_block;
-  // Step 2: Get offset of the inode in the inode on-disk block
-  int offset = ino%inodes_per_block;
-  // Step 3: Write inode to disk
-  char* buffer = malloc(BLOCK_SIZE);
-  bio_read(block_no+s_block->i_start_blk, (void*)buffer);
-  memcpy((void*) &buffer[sizeof(struct inode)*offset], (void*) inode, sizeof(struct inode));
-  bio_write(block_no+s_block->i_start_blk, (const void*) buffer);
-  free(buffer);
-	return 0;
+void dcache_release() {
+	pthread_mutex_lock(&dcache_lock);
+	struct dentry *d = dcache_lru.next;
+	while(d != &dcache_lru){
+		struct dentry *next = d->next;
+		free(d);
+		d = next;
+	}
+	dcache_lru.next = dcache_lru.prev = &dcache_lru;
+	memset(dcache_hash, 0, sizeof(dcache_hash));
+	dcache_count = 0;
+	pthread_mutex_unlock(&dcache_lock);
 }
 
 
 /* 
  * directory operations
+ *
+ * A directory starts out "linear": a single block of packed records (see
+ * struct dir_leaf in tfs.h). When that block fills up it is converted to
+ * a hashed index in the style of ext3's htree: logical block 0 becomes a
+ * dx_root mapping name-hash ranges to leaf blocks, and each leaf holds the
+ * records whose hashes fall in its range. Lookup, insert and remove then
+ * read the root plus one leaf however big the directory is. Full leaves
+ * are split in two by hash.
  */
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
-  struct dirent * temp_dirent = malloc(sizeof(struct dirent));
-  // Step 1: Call readi() to get the inode using ino (inode number of current directory)
-  struct inode *ino_temp = malloc(sizeof(struct inode));
-  readi(ino, ino_temp);
-  int num_entries = BLOCK_SIZE/sizeof(struct dirent);
-  int num_blocks = ino_temp->size/BLOCK_SIZE;
-  if(ino_temp->size%BLOCK_SIZE != 0){
-	  num_blocks++;
-  }
-  //printf("num entries in %d :%d\n", ino, num_entries);
-  // Step 2: Get data block of current directory from inode
-  // may have mutiple data blocks but will deal with that later
-  int j;
-  for(j = 0;  j < num_blocks;j++){
-  	int block_no =  ino_temp->direct_ptr[j];
-  	printf("block_no: %d\n", block_no);
-  // Step 3: Read directory's data block and check each directory entry.
-  //If the name matches, then copy directory entry to dirent structure
-  	char * buffer = malloc(BLOCK_SIZE);
-  	bio_read(s_block->d_start_blk+block_no, (void*)buffer);
-  	int i;
-  	for(i = 0; i < num_entries; i++){
-		printf("DIR FIND ITERATION: %d\n", i);	
-  		memcpy(temp_dirent, &buffer[i*sizeof(struct dirent)], sizeof(struct dirent));
-		if(temp_dirent->valid == 1){
-			printf("ENTRY WAS VALID\n");
-			if(strcmp(fname, temp_dirent->name)==0){
-				printf("FOUND IT\n");
-				memcpy(dirent, temp_dirent, sizeof(struct dirent));
-				char* buffer_name = malloc(sizeof(char)*(208));
-				memcpy(buffer_name, temp_dirent->name, strlen(temp_dirent->name)+1);
-				//dirent->name[strlen(temp_dirent->name)] = '\0';
-				printf("DIRENT's NAME: -%s-\n", dirent->name);
-				free(temp_dirent);
-				free(ino_temp);
-				free(buffer);
-				memcpy(dirent->name,  buffer_name, strlen(buffer_name));
-				dirent->name[strlen(buffer_name)] = '\0';
-				free(buffer_name);
-				printf("DIRENT's NAME: -%s-\n", dirent->name);
-				return 1;
-			}else{
-				printf("DIDN'T FIND IT: temp_dirent->name: %s which is not the same as: %s\n", temp_dirent->name, fname);
-			}
+
+//FNV-1a
+static uint32_t dx_hash(const char *name, size_t len) {
+	uint32_t h = 2166136261u;
+	size_t i;
+	for(i = 0; i < len; i++){
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+//on-disk block number of logical block lblk of a directory
+static inline int dir_block(struct inode *dir, int lblk) {
+	return data_block(bmap(dir, lblk, NULL));
+}
+
+//index of the dx entry whose hash range contains hash
+static int dx_find_entry(struct dx_root *root, uint32_t hash) {
+	int lo = 0, hi = root->count-1;
+	while(lo < hi){
+		int mid = (lo+hi+1)/2;
+		if(root->entries[mid].hash <= hash){
+			lo = mid;
 		}else{
-			printf("ENTRY WAS INVALID\n");
+			hi = mid-1;
 		}
-  	}
-  
-	//failure
-	free(buffer);
-  }
-	free(ino_temp);
-	free(temp_dirent);
-  return -1;
+	}
+	return lo;
+}
+
+static inline struct dir_rec *leaf_rec(struct dir_leaf *leaf, int off) {
+	return (struct dir_rec*)(leaf->recs+off);
 }
 
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+//Offset of fname's record in leaf, or -1
+static int leaf_find(struct dir_leaf *leaf, const char *fname, size_t name_len) {
+	int off;
+	for(off = 0; off < leaf->used; off += DIR_REC_LEN(leaf_rec(leaf, off)->name_len)){
+		struct dir_rec *r = leaf_rec(leaf, off);
+		if(r->name_len == name_len && memcmp(r->name, fname, name_len) == 0){
+			return off;
+		}
+	}
+	return -1;
+}
+
+//Append a record to leaf, -1 if it doesn't fit
+static int leaf_add(struct dir_leaf *leaf, uint32_t f_ino, const char *fname, size_t name_len) {
+	int len = DIR_REC_LEN(name_len);
+	if(leaf->used+len > DIR_SPACE){
+		return -1;
+	}
+	struct dir_rec *r = leaf_rec(leaf, leaf->used);
+	memset(r, 0, len);
+	r->ino = f_ino;
+	r->name_len = name_len;
+	memcpy(r->name, fname, name_len);
+	leaf->used += len;
+	leaf->count++;
+	return 0;
+}
 
-	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
+//Drop the record at off, closing the gap
+static void leaf_remove(struct dir_leaf *leaf, int off) {
+	int len = DIR_REC_LEN(leaf_rec(leaf, off)->name_len);
+	memmove(leaf->recs+off, leaf->recs+off+len, leaf->used-off-len);
+	memset(leaf->recs+leaf->used-len, 0, len);
+	leaf->used -= len;
+	leaf->count--;
+}
 
-	printf("-------WE ARE IN DIR ADD: directory inode: %d  new entry inode %d   name %s -------\n", dir_inode.ino, f_ino, fname);
+static void dirent_fill(struct dirent *d, struct dir_rec *r) {
+	memset(d, 0, sizeof(struct dirent));
+	d->ino = r->ino;
+	d->valid = 1;
+	memcpy(d->name, r->name, r->name_len);
+	d->name[r->name_len] = '\0';
+	d->len = r->name_len;
+}
 
-	// Step 2: Check if fname (directory name) is already used in other entries
-	int num_blocks = dir_inode.size/BLOCK_SIZE;
-	//printf("yo!\n");
-	int entries_per_block = BLOCK_SIZE/sizeof(struct dirent);
-	if(dir_inode.size%BLOCK_SIZE != 0){
-		num_blocks++;
+/*
+ * Give directory dir a new, empty logical block lblk. The caller writes the
+ * updated inode.
+ */
+static int dir_new_block(struct inode *dir, int lblk) {
+	if(bmap_alloc(dir, lblk, 1, NULL) < 0){
+		return -1;
 	}
-	//printf("num_blocks: %d\n", num_blocks);
-	int num_entries = dir_inode.size/sizeof(struct dirent);
-	int i, j;
-	for(i = 0; i < num_blocks;i++){
-		printf("OUTER ITERATION OF SEARCH %d\n", i);
-		char * block = malloc(BLOCK_SIZE);
-		bio_read(dir_inode.direct_ptr[i]+s_block->d_start_blk, block);
-		for(j=0; j < entries_per_block;j++){	
-			printf("INNER ITERATION OF SEARCH %d\n", j);
-			struct dirent* temp = malloc(sizeof(struct dirent));
-			memcpy(temp, &block[j*sizeof(struct dirent)], sizeof(struct dirent) );
-			if(temp->valid == 1){
-				printf("ENTRY WAS VALID\n");
-				if(temp->len == name_len && strcmp(fname, temp->name)==0){
-					printf("DUPLICATE FILE\n");
-					free(block);
-					free(temp);
-					return -1;
-				}else{
-					printf("NOT A DUPLICATE\n");
-				}
-			}else{
-				printf("ENTRY WAS INVALID\n");
-			}
-			free(temp);
-				
-		}
-		free(block);
-	}
-	printf("**SEARCH DONE, WAS NOT A DUPLICATE!**\n");
-	// Step 3: Add directory entry in dir_inode's data block and write to disk
-	int j_pos = -1, i_pos=-1;
-	for(i = 0; i < num_blocks;i++){
-		char * block = malloc(BLOCK_SIZE);
-		bio_read(dir_inode.direct_ptr[i]+s_block->d_start_blk, block);
-		for(j=0; j < entries_per_block;j++){
-			struct dirent* temp = malloc(sizeof(struct dirent));
-			memcpy(temp, &block[j*sizeof(struct dirent)], sizeof(struct dirent) );
-			if(temp->valid == 0){
-				j_pos = j;
-				i_pos = i;
-				free(temp);
-				break;
+	if(dir->size < (lblk+1)*BLOCK_SIZE){
+		dir->size = (lblk+1)*BLOCK_SIZE;
+	}
+	return bmap(dir, lblk, NULL);
+}
+
+int dir_find(uint32_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+
+	// Step 1: Call readi() to get the inode using ino (inode number of current directory)
+	struct inode dir;
+	readi(ino, &dir);
+	if(dir.valid != 1 || dir.type != _DIRECTORY_){
+		return -1;
+	}
+	struct dir_leaf *leaf = malloc(BLOCK_SIZE);
+	int off, lblk, ret = -1;
+	uint32_t hash = 0;
+
+	// Step 2: Get the data block(s) that could hold fname
+	if(dir.flags & INODE_FL_INDEX){
+		struct dx_root *root = (struct dx_root*)leaf;
+		bio_read(dir_block(&dir, 0), root);
+		hash = dx_hash(fname, name_len);
+		lblk = root->entries[dx_find_entry(root, hash)].block;
+		bio_read(dir_block(&dir, lblk), leaf);
+		// Step 3: If the name matches, then copy directory entry to dirent structure
+		if((off = leaf_find(leaf, fname, name_len)) >= 0){
+			dirent_fill(dirent, leaf_rec(leaf, off));
+			ret = 1;
+		}
+	}else{
+		for(lblk = 0; lblk < dir.size/BLOCK_SIZE && ret < 0; lblk++){
+			bio_read(dir_block(&dir, lblk), leaf);
+			if((off = leaf_find(leaf, fname, name_len)) >= 0){
+				dirent_fill(dirent, leaf_rec(leaf, off));
+				ret = 1;
 			}
-			free(temp);
-				
 		}
-		if(j_pos > 0){
-			free(block);
-			break;
+	}
+	free(leaf);
+	TRACE(TRACE_DEBUG, TR_LOOKUP, ino, hash, ret > 0 ? dirent->ino : -1);
+	return ret;
+}
+
+/*
+ * Insert into a linear directory with one pass over its blocks, checking
+ * for duplicates while looking for one with room. A new directory has no
+ * blocks until its first entry is added here.
+ * Returns 1 if the directory is full and should be converted to an index.
+ */
+static int dir_add_linear(struct inode *dir, struct dir_leaf *leaf, uint32_t f_ino, const char *fname, size_t name_len) {
+	int num_blocks = dir->size/BLOCK_SIZE;
+	int lblk, free_lblk = -1;
+
+	for(lblk = 0; lblk < num_blocks; lblk++){
+		bio_read(dir_block(dir, lblk), leaf);
+		if(leaf_find(leaf, fname, name_len) >= 0){
+			return -1;
 		}
-		free(block);
-	}
-	//printf("\n");
-	// Allocate a new data block for this directory if it does not exist
-	if(j_pos < 0){
-		//find empty data block and allocate it 
-		char * block = malloc(BLOCK_SIZE);
-		bio_read(s_block->d_bitmap_blk, block);
-		printf("NO BLOCKS AVAILABLE??? NEED TO ADD A NEW ONE??\n");
-		int i, j;
-		for(i =0; i < MAX_DNUM; i++){
-			if(get_bitmap((bitmap_t) block, i)==0){
-				//block is invalid, aka free to be given to inode
-				printf("found an empty block\n");
-				set_bitmap((bitmap_t) block, i);
-				bio_write(s_block->d_bitmap_blk, block);
-				dir_inode.size+=BLOCK_SIZE;
-				dir_inode.direct_ptr[dir_inode.size/BLOCK_SIZE-1] = i;
-				writei(dir_inode.ino, &dir_inode);
-			//	free(block);
-				char * new_data_block = malloc(BLOCK_SIZE);
-				struct dirent temp;
-				temp.valid = 0;
-				//fill block with dirents
-				for(j =0; j < BLOCK_SIZE/sizeof(struct dirent);j++){
-					memcpy(&new_data_block[j*sizeof(struct dirent)], &temp, sizeof(struct dirent)); 
-				}
-				bio_write(i+s_block->d_start_blk, new_data_block);
-				i_pos = dir_inode.size/BLOCK_SIZE-1;
-				j_pos = 0;
-				free(new_data_block);
-				break;	
+		if(free_lblk < 0 && leaf->used+(int)DIR_REC_LEN(name_len) <= DIR_SPACE){
+			free_lblk = lblk;
+		}
+	}
 
-			}else{
-				printf("%d \n", i);
-			}
+	if(free_lblk < 0){
+		if(num_blocks == 1){
+			return 1;
 		}
-		free(block);
+		// Allocate a new data block for this directory
+		free_lblk = num_blocks;
+		if(dir_new_block(dir, free_lblk) < 0){
+			return -1;
+		}
+		memset(leaf, 0, BLOCK_SIZE);
+		writei(dir->ino, dir);
+	}else if(free_lblk != num_blocks-1){
+		bio_read(dir_block(dir, free_lblk), leaf);
+	}
+
+	leaf_add(leaf, f_ino, fname, name_len);
+	bio_write(dir_block(dir, free_lblk), leaf);
+	return 0;
+}
+
+/*
+ * Turn a full single-block directory into an indexed one: its records move
+ * to a new leaf at logical block 1 and block 0 becomes the dx_root.
+ */
+static int dx_convert(struct inode *dir, struct dir_leaf *leaf) {
+	bio_read(dir_block(dir, 0), leaf);
+	if(dir_new_block(dir, 1) < 0){
+		return -1;
 	}
+	bio_write(dir_block(dir, 1), leaf);
+
+	struct dx_root *root = (struct dx_root*)leaf;
+	memset(root, 0, BLOCK_SIZE);
+	root->magic = DX_MAGIC;
+	root->count = 1;
+	root->entries[0].hash = 0;
+	root->entries[0].block = 1;
+	bio_write(dir_block(dir, 0), root);
+
+	dir->flags |= INODE_FL_INDEX;
+	writei(dir->ino, dir);
+	return 0;
+}
 
-	printf("ENTERED IN DIRENT BLOCK: %d POSITION %dyo\n", i_pos, j_pos);
-	// Update directory inode
-	char* block = malloc(BLOCK_SIZE);
-	bio_read(dir_inode.direct_ptr[i_pos]+s_block->d_start_blk, block);
-	struct dirent *temp = malloc(sizeof(struct dirent));
-	memcpy(temp, &block[j_pos*sizeof(struct dirent)], sizeof(struct dirent));
-	//char temp_name[208];
-	memcpy(temp->name, fname, name_len);
-	temp->name[name_len] = '\0';
-	printf("NEW NAME: %s+ length: %ld\n", temp->name, name_len);
-	temp->valid = 1;
-	temp->ino = f_ino;
-	temp->len = name_len;
+struct hashed_rec {
+	uint32_t	hash;
+	struct dir_rec *rec;
+};
 
+static int cmp_hashed_rec(const void *a, const void *b) {
+	uint32_t x = ((const struct hashed_rec*)a)->hash;
+	uint32_t y = ((const struct hashed_rec*)b)->hash;
+	return (x > y) - (x < y);
+}
 
-	memcpy(&block[j_pos*sizeof(struct dirent)], temp, sizeof(struct dirent));
-	
-	free(temp);
-	temp = malloc(sizeof(struct dirent));
-	// Write directory entry
-	bio_write(dir_inode.direct_ptr[i_pos]+s_block->d_start_blk, block);
-	bio_read(dir_inode.direct_ptr[i_pos]+s_block->d_start_blk, block);
-	memcpy(temp, &block[j_pos*sizeof(struct dirent)], sizeof(struct dirent));
-	printf("************temp-> valid: %d   temp->ino: %d temp->name %s********\n", temp->valid, temp->ino, temp->name);
-	free(temp);
-	free(block);
+/*
+ * Split the full leaf for root->entries[idx] while inserting newrec: the
+ * records are sorted by hash and those past the middle byte move to a new
+ * leaf, which gets its own dx entry right after idx.
+ */
+static int dx_split(struct inode *dir, struct dx_root *root, int idx, struct dir_leaf *leaf, struct dir_rec *newrec) {
+	int n = leaf->count+1, i, k, off, bytes;
+	if(root->count >= DX_MAX_ENTRIES){
+		return -1;
+	}
+	//the records are copied out as the leaf is rewritten
+	struct dir_leaf *old = malloc(BLOCK_SIZE);
+	memcpy(old, leaf, BLOCK_SIZE);
+	struct hashed_rec *all = malloc(sizeof(struct hashed_rec)*n);
+	for(i = 0, off = 0; i < n; i++){
+		all[i].rec = i < n-1 ? leaf_rec(old, off) : newrec;
+		all[i].hash = dx_hash(all[i].rec->name, all[i].rec->name_len);
+		off += DIR_REC_LEN(all[i].rec->name_len);
+	}
+	qsort(all, n, sizeof(struct hashed_rec), cmp_hashed_rec);
+
+	//split by bytes, but entries with equal hashes have to stay in the same leaf
+	for(k = 0, bytes = 0; k < n-1 && bytes < off/2; k++){
+		bytes += DIR_REC_LEN(all[k].rec->name_len);
+	}
+	for(; k > 0 && all[k].hash == all[k-1].hash; k--);
+	if(k == 0){
+		for(k = 1; k < n && all[k].hash == all[0].hash; k++);
+	}
+	//both halves have to fit before the new block is allocated, so a failed
+	//split leaves the directory as it was
+	for(i = 0, bytes = 0; i < k; i++){
+		bytes += DIR_REC_LEN(all[i].rec->name_len);
+	}
+	int new_lblk = dir->size/BLOCK_SIZE;
+	if(k == n || bytes > DIR_SPACE || off-bytes > DIR_SPACE || dir_new_block(dir, new_lblk) < 0){
+		free(all);
+		free(old);
+		return -1;
+	}
+	struct dir_leaf *right = calloc(1, BLOCK_SIZE);
+	memset(leaf, 0, BLOCK_SIZE);
+	for(i = 0; i < n; i++){
+		leaf_add(i < k ? leaf : right, all[i].rec->ino, all[i].rec->name, all[i].rec->name_len);
+	}
+	bio_write(dir_block(dir, root->entries[idx].block), leaf);
+	bio_write(dir_block(dir, new_lblk), right);
+	memmove(&root->entries[idx+2], &root->entries[idx+1], sizeof(struct dx_entry)*(root->count-idx-1));
+	root->entries[idx+1].hash = all[k].hash;
+	root->entries[idx+1].block = new_lblk;
+	root->count++;
+	bio_write(dir_block(dir, 0), root);
+	writei(dir->ino, dir);
+	free(right);
+	free(all);
+	free(old);
 	return 0;
 }
 
-int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
+static int dx_add(struct inode *dir, struct dir_leaf *leaf, uint32_t f_ino, const char *fname, size_t name_len) {
+	struct dx_root *root = malloc(BLOCK_SIZE);
+	bio_read(dir_block(dir, 0), root);
+	int idx = dx_find_entry(root, dx_hash(fname, name_len));
+	int lblk = root->entries[idx].block;
+	bio_read(dir_block(dir, lblk), leaf);
+
+	int ret = 0;
+	if(leaf_find(leaf, fname, name_len) >= 0){
+		ret = -1;
+	}else if(leaf_add(leaf, f_ino, fname, name_len) == 0){
+		bio_write(dir_block(dir, lblk), leaf);
+	}else{
+		struct dir_rec *newrec = calloc(1, DIR_REC_LEN(name_len));
+		newrec->ino = f_ino;
+		newrec->name_len = name_len;
+		memcpy(newrec->name, fname, name_len);
+		ret = dx_split(dir, root, idx, leaf, newrec);
+		free(newrec);
+	}
+	free(root);
+	return ret;
+}
 
-	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
-	int num_blocks = dir_inode.size/BLOCK_SIZE;
-	printf("dir_inode's size is %d\n", dir_inode.size);
-	int i, j;
-	for(i=0; i < num_blocks; i++){
-		char * buffer = malloc(BLOCK_SIZE);
-		bio_read(dir_inode.direct_ptr[i]+s_block->d_start_blk, buffer );
-		for(j=0; j < BLOCK_SIZE/sizeof(struct dirent);j++){
-			printf("iteration #%d\n", j);
-			struct dirent* cur_dirent= malloc(sizeof(struct dirent));
-			memcpy(cur_dirent, &buffer[j*sizeof(struct dirent)], sizeof(struct dirent));
-			if(strcmp(fname, cur_dirent->name) == 0 && name_len == cur_dirent->len){
-				cur_dirent->valid = 0;
-				memcpy(&buffer[j*sizeof(struct dirent)], cur_dirent, sizeof(struct dirent));
-				bio_write(dir_inode.direct_ptr[i]+s_block->d_start_blk, buffer);
-				free(cur_dirent);
-				free(buffer);
-				return 0; 	
-			}else{
-				printf("searching for: %s found: %s search length:%ld found length:%d\n", fname, cur_dirent->name, name_len, cur_dirent->len);
+int dir_add(struct inode dir_inode, uint32_t f_ino, const char *fname, size_t name_len) {
 
+	if(name_len >= sizeof(((struct dirent*)0)->name)){
+		return -1;
+	}
+	struct dir_leaf *leaf = malloc(BLOCK_SIZE);
+	int ret;
+	// Step 1: Check if fname is already used and find room for it, converting
+	// the directory to an indexed one once its first block is full
+	if(!(dir_inode.flags & INODE_FL_INDEX)){
+		ret = dir_add_linear(&dir_inode, leaf, f_ino, fname, name_len);
+		if(ret != 1 || dx_convert(&dir_inode, leaf) < 0){
+			free(leaf);
+			if(ret == 0){
+				dcache_insert(dir_inode.ino, fname, name_len, f_ino);
 			}
-			free(cur_dirent);
-			
+			return ret == 1 ? -1 : ret;
 		}
-		free(buffer);
 	}
-	// Step 2: Check if fname exist
+	// Step 2: Add directory entry in the leaf its hash maps to
+	ret = dx_add(&dir_inode, leaf, f_ino, fname, name_len);
+	free(leaf);
+	if(ret == 0){
+		dcache_insert(dir_inode.ino, fname, name_len, f_ino);
+	}
+	return ret;
+}
 
-	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
+int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
 
-	return -1;
+	struct dir_leaf *leaf = malloc(BLOCK_SIZE);
+	int off, lblk, ret = -1;
+	// Step 1: Read the data block(s) of dir_inode that could hold fname
+	if(dir_inode.flags & INODE_FL_INDEX){
+		struct dx_root *root = (struct dx_root*)leaf;
+		bio_read(dir_block(&dir_inode, 0), root);
+		lblk = root->entries[dx_find_entry(root, dx_hash(fname, name_len))].block;
+		bio_read(dir_block(&dir_inode, lblk), leaf);
+		// Step 2: If fname exists, remove it from the block and write it to disk
+		if((off = leaf_find(leaf, fname, name_len)) >= 0){
+			leaf_remove(leaf, off);
+			bio_write(dir_block(&dir_inode, lblk), leaf);
+			ret = 0;
+		}
+	}else{
+		for(lblk = 0; lblk < dir_inode.size/BLOCK_SIZE && ret < 0; lblk++){
+			bio_read(dir_block(&dir_inode, lblk), leaf);
+			if((off = leaf_find(leaf, fname, name_len)) >= 0){
+				leaf_remove(leaf, off);
+				bio_write(dir_block(&dir_inode, lblk), leaf);
+				ret = 0;
+			}
+		}
+	}
+	free(leaf);
+	if(ret == 0){
+		dcache_insert(dir_inode.ino, fname, name_len, -1);
+	}
+	return ret;
 }
 
 /* 
  * namei operation
  */
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
+int get_node_by_path(const char *path, uint32_t ino, struct inode *inode) {
 	
 	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
-	// Note: You could either implement it in a iterative way or recursive way
+	// Each component is looked up in the dentry cache first and only goes to
+	// dir_find() on a miss; misses are cached, including names that don't exist.
+	const char *name = path;
+	int cur = ino; //root directory should always be passed (0)
+	struct dirent dirent;
+	while(1){
+		while(*name == '/'){
+			name++;
+		}
+		if(*name == '\0'){
+			break;
+		}
+		const char *end = strchr(name, '/');
+		size_t len = end != NULL ? (size_t)(end-name) : strlen(name);
 
-	printf("PATH: %s\n", path);
-	
-	char* path_cpy = malloc(sizeof(char)*(strlen(path)+1));
-	memcpy(path_cpy, path, strlen(path));
-	path_cpy[strlen(path)] = '\0';
-	char* token = strtok((char*)path_cpy, "/");
-	char* path_build = malloc(sizeof(char)*(strlen(path)+1));
-	printf("PATH: %s\n", path);
-	int f;
-	for(f = 0; f < strlen(path);f++){
-		path_build[f] = '\0';
-	}
-	int dir_inode = ino; //root directory should always be passed (0)
-	struct dirent * dirent = malloc(sizeof(struct dirent));
-	while(token != NULL){
-	//	printf("token: --%s--: directory: %d\n", token, dir_inode);
-		readi(dir_inode, inode);
-		if(inode->valid == 1){
-			printf("its the validity check\n");	
-			int ret = dir_find(dir_inode, token, strlen(token), dirent);
-			if(ret == -1){
-	//			printf("SUPER BLOCK TEST: %d\n",s_block->i_start_blk);
-				printf("dir_find failed\n");
+		int next = dcache_lookup(cur, name, len);
+		if(next == DCACHE_NEG){
+			return -1;
+		}
+		if(next == DCACHE_MISS){
+			struct cached_inode *dir = ilock(cur, 0);
+			if(dir == NULL){
 				return -1;
-			}else{
-				strcat(path_build, "/");
-				strcat(path_build, dirent->name);
-				if((strcmp(path_build, path)==0)&&(strlen(path_build) == strlen(path))){
-					readi(dirent->ino, inode);
-					printf("THE SAME: path_build: %s actual path: %s  path_build length: %ld actual path length: %ld\n", path_build, path, strlen(path_build), strlen(path));
-					return inode->ino;
-				}else{
-					printf("NOT THE SAME: path_build: %s actual path: %s  path_build length: %ld actual path length: %ld\n", path_build, path, strlen(path_build), strlen(path));
-				}
-				dir_inode = dirent->ino;
-				token=strtok(NULL, "/");
 			}
-		}else{
-			printf("inode with number %d wasnt valid\n", inode->ino);
-			return -1;
+			if(dir_find(cur, name, len, &dirent) < 0){
+				dcache_insert(cur, name, len, -1);
+				iunlock(dir);
+				return -1;
+			}
+			next = dirent.ino;
+			dcache_insert(cur, name, len, next);
+			iunlock(dir);
 		}
-
-		
+		cur = next;
+		name += len;
 	}
-	
-	if(strcmp(path, "/") == 0 &&strlen(path)==1){
-		return 0;
+
+	readi(cur, inode);
+	if(inode->valid != 1){
+		return -1;
 	}
-	return -1;
+	return cur;
 }
 
 /* 
  * Make file system
  */
-int tfs_mkfs() {
-	pthread_mutex_lock(&lock);
-	// Call dev_init() to initialize (Create) Diskfile
-	dev_init(diskfile_path);
-	// write superblock information
-	char * buffer = malloc(BLOCK_SIZE);
-	s_block = malloc(sizeof(s_block));
-	s_block->magic_num = MAGIC_NUM;
-	s_block->max_inum = MAX_INUM;
-	s_block->max_dnum = MAX_DNUM;
-	s_block->i_bitmap_blk = 1;
-	s_block->d_bitmap_blk = 2;
-	s_block->i_start_blk = 3;
-	int inode_blocks = BLOCK_SIZE/sizeof(struct inode);
-	if(BLOCK_SIZE%(sizeof(struct inode))!= 0){
-		inode_blocks++;
-	}
-	s_block->d_start_blk =inode_blocks+3;
-	memcpy(buffer, s_block, sizeof(struct superblock));
-	bio_write(0, (const void*)buffer);
-	free(buffer);
-	char* inode_bitmap_block = malloc(BLOCK_SIZE);
-	char* data_bitmap_block = malloc(BLOCK_SIZE);
-	// initialize inode bitmap
-	bitmap_t inode_bitmap = malloc(MAX_INUM/8);
-	memset(inode_bitmap, 0, MAX_INUM/8);
-
-	int z;
-	for(z = 0; z < MAX_INUM; z++){
-		if(get_bitmap(inode_bitmap, z)==1){
-			printf("%d something went wrong\n", z );
-		}
+static struct tfs_geometry geometry = { DEFAULT_DISK_SIZE, DEFAULT_INODES, 0, BLOCKS_PER_GROUP };
 
+void tfs_geometry_config(const struct tfs_geometry *geo) {
+	if(geo->disk_size != 0){
+		geometry.disk_size = geo->disk_size;
 	}
-	// initialize data block bitmap
-	bitmap_t data_bitmap = malloc(MAX_DNUM/8);
-	memset(data_bitmap, 0, MAX_DNUM/8);
-	// update bitmap information for root directory	
-	for(z = 0; z < MAX_DNUM; z++){
-		if(get_bitmap((bitmap_t)data_bitmap, z)==1){
-			printf("%d ---something went wrong\n", z );
-		}
-
+	if(geo->inodes != 0){
+		geometry.inodes = geo->inodes;
+	}
+	if(geo->journal_blocks != 0){
+		geometry.journal_blocks = geo->journal_blocks;
+	}
+	if(geo->blocks_per_group != 0){
+		geometry.blocks_per_group = geo->blocks_per_group;
 	}
+}
 
-	printf("anything wrong?\n");
+/*
+ * Lay out a file system of the configured geometry in sb: the fixed size
+ * regions first, then the data block bitmap and the data region split
+ * what is left so the bitmap just covers the data blocks. Unless its size
+ * was given, the journal is made big enough for a transaction of this
+ * geometry, see the journal section. The data blocks are then cut into
+ * groups of blocks_per_group (a whole number of bitmap words) and the
+ * inodes shared out evenly between them.
+ */
+static int mkfs_layout(struct superblock *sb) {
+	uint64_t total = geometry.disk_size/BLOCK_SIZE, rest;
+	memset(sb, 0, sizeof(*sb));
+	sb->magic_num = MAGIC_NUM;
+	sb->version = TFS_VERSION;
+	sb->block_size = BLOCK_SIZE;
+	sb->disk_size = total*BLOCK_SIZE;
+	sb->max_inum = geometry.inodes;
+	//the journal sits right after the superblock
+	sb->j_start_blk = 1;
+	sb->j_blocks = geometry.journal_blocks != 0 ? geometry.journal_blocks : JOURNAL_BLOCKS;
+	for(;;){
+		sb->i_bitmap_blk = sb->j_start_blk + sb->j_blocks;
+		sb->i_bitmap_blocks = bitmap_blocks(sb->max_inum);
+		sb->d_bitmap_blk = sb->i_bitmap_blk + sb->i_bitmap_blocks;
+		sb->i_blocks = (sb->max_inum + inodes_per_block()-1)/inodes_per_block();
+		rest = (uint64_t)sb->d_bitmap_blk + sb->i_blocks;
+		//block numbers are ints, and the root directory needs an inode and a block
+		if(sb->max_inum == 0 || total > INT32_MAX || total < rest+2){
+			return -EINVAL;
+		}
+		rest = total - rest;
+		sb->d_bitmap_blocks = (rest + BITS_PER_BLOCK)/(BITS_PER_BLOCK+1);
+		//a transaction holds all the bitmap blocks and the biggest operation
+		uint32_t need = 2 + sb->i_bitmap_blocks + sb->d_bitmap_blocks + txn_data_credits(WRITE_CHUNK);
+		if(sb->j_blocks >= need){
+			break;
+		}
+		if(geometry.journal_blocks != 0 || need > JNL_DESC_MAX+2){
+			return -EINVAL;
+		}
+		//a bigger journal only leaves a smaller data bitmap, so the next round fits
+		sb->j_blocks = need;
+	}
+	sb->max_dnum = rest - sb->d_bitmap_blocks;
+	sb->i_start_blk = sb->d_bitmap_blk + sb->d_bitmap_blocks;
+	sb->d_start_blk = sb->i_start_blk + sb->i_blocks;
+	sb->blocks_per_group = (geometry.blocks_per_group+63)/64*64;
+	sb->groups = (sb->max_dnum + sb->blocks_per_group-1)/sb->blocks_per_group;
+	sb->inodes_per_group = ((sb->max_inum + sb->groups-1)/sb->groups + 63)/64*64;
+	return 0;
+}
 
+int tfs_mkfs(const char *diskfile) {
+	struct superblock sb;
+	if(mkfs_layout(&sb) < 0){
+		return -EINVAL;
+	}
+	// Call dev_init() to initialize (Create) Diskfile
+	dev_init(diskfile, sb.disk_size);
+	// write superblock information
+	char * buffer = calloc(1, BLOCK_SIZE);
+	s_block = malloc(sizeof(struct superblock));
+	memcpy(s_block, &sb, sizeof(struct superblock));
+	memcpy(buffer, s_block, sizeof(struct superblock));
+	bio_write(0, (const void*)buffer);
+	free(buffer);
 
-	set_bitmap(inode_bitmap, 0);
-	set_bitmap(data_bitmap, 0);
-	memcpy(inode_bitmap_block, inode_bitmap, MAX_INUM/8);
-	memcpy(data_bitmap_block, data_bitmap, MAX_INUM/8);
+	// initialize inode bitmap and data block bitmap
+	bitmap_init(&ino_bmap, s_block->i_bitmap_blk, s_block->max_inum, 0);
+	bitmap_init(&blk_bmap, s_block->d_bitmap_blk, s_block->max_dnum, 0);
 
-	bio_write(1, inode_bitmap_block);
-	bio_write(2, data_bitmap_block);
+	groups_init();
 
-	free(inode_bitmap_block);
-	free(data_bitmap_block);
+	// update bitmap information for root directory	
+	int got;
+	group_alloc_ino(0);
+	group_alloc_blkrun(0, -1, 1, 1, &got);
+	bitmap_sync(&ino_bmap);
+	bitmap_sync(&blk_bmap);
 
 	// update inode for root directory
-	buffer = malloc(BLOCK_SIZE);
-	bio_read(3, buffer);
 	struct inode * temp_inode = malloc(sizeof(struct inode));
-	memcpy(temp_inode, buffer, sizeof(struct inode));
+	memset(temp_inode, 0, sizeof(struct inode));
 
 	temp_inode->ino = 0;
 	temp_inode->valid = 1;
@@ -528,690 +2404,983 @@ int tfs_mkfs() {
 	temp_inode->type = _DIRECTORY_;
 	temp_inode->link = 1;
 	//need to set stat still, also set up data block
-	temp_inode->direct_ptr[0] = 0;
-	int l;
-	for(l=1;l<16;l++){
-		temp_inode->direct_ptr[l] = -1;
-	}
-	char *buffer2 = malloc(BLOCK_SIZE);
-	bio_read(s_block->d_start_blk, buffer2);
-	int i;
-	struct dirent* temp_dirent = malloc(sizeof(struct dirent));
-	temp_dirent->valid = 0;
-	for(i = 0; i < BLOCK_SIZE/sizeof(struct dirent); i++){
-		memcpy(&buffer[i*sizeof(struct dirent)], temp_dirent, sizeof(struct dirent));
-	}
-	free(temp_dirent);
-	bio_write(s_block->d_start_blk, buffer2);
-	free(buffer2);
-
-	memcpy(buffer, temp_inode, sizeof(struct inode));
-	bio_write(3, buffer);
+	ext_init(temp_inode);
+	ext_add(temp_inode, 0, 0, 1);
+	//an empty directory block: no records
+	buffer = calloc(1, BLOCK_SIZE);
+	bio_write(s_block->d_start_blk, buffer);
 	free(buffer);
 
+	writei(0, temp_inode);
+	sync_inodes();
+	free(temp_inode);
+	//the journal isn't running yet, so put the new file system straight on disk
+	bio_flush();
+	bio_sync();
 
-	buffer = malloc(BLOCK_SIZE);
-	//update inode bitmap block
-	bio_read(s_block->i_bitmap_blk, buffer);
-	set_bitmap((bitmap_t)buffer, 0);
-	bio_write(s_block->i_bitmap_blk, buffer);
-
-
-	bio_read(s_block->d_bitmap_blk, buffer);
-	set_bitmap((bitmap_t)buffer, 0);
-	bio_write(s_block->d_bitmap_blk, buffer);
-	free(buffer);
-
-	pthread_mutex_unlock(&lock);
 	return 0;
 }
 
 
 /* 
- * FUSE file operations
+ * File system operations (see libtfs.h)
  */
-static void *tfs_init(struct fuse_conn_info *conn) {
+void tfs_delalloc_config(int on) {
+	delalloc = on;
+}
+
+int tfs_mount(const char *diskfile, const char *tracefile) {
 
-	pthread_mutex_lock(&lock);
+	// mount and unmount run before/after every other operation, no locking needed
 	// Step 1a: If disk file is not found, call mkfs
-	printf("WE'RE INITIALIZING????\n");
-	disk_file = dev_open(diskfile_path);
+	if(tracefile != NULL && tracefile[0] != '\0'){
+		trace_open(tracefile);
+	}
+	disk_file = dev_open(diskfile);
 	if(disk_file < 0){
-		pthread_mutex_unlock(&lock);
-		tfs_mkfs();
-		pthread_mutex_lock(&lock);
-		disk_file = dev_open(diskfile_path);
-		printf("SUPERBLOCK i start blk: %d\n", s_block->i_start_blk);
-	    	
+		int ret = tfs_mkfs(diskfile);
+		if(ret < 0){
+			return ret;
+		}
+		disk_file = dev_open(diskfile);
+		TRACE(TRACE_INFO, TR_MKFS, s_block->i_start_blk, s_block->d_start_blk, s_block->j_blocks);
 	}else{
 		s_block = malloc(sizeof(struct superblock));
 		char* buffer = malloc(BLOCK_SIZE);
 		bio_read(0, buffer);
 		memcpy(s_block, buffer, sizeof(struct superblock));
 		free(buffer);
+		//the geometry comes from the superblock, but BLOCK_SIZE and the format are compiled in
+		if(s_block->magic_num != MAGIC_NUM || s_block->version != TFS_VERSION || s_block->block_size != BLOCK_SIZE){
+			free(s_block);
+			s_block = NULL;
+			dev_close();
+			return -EINVAL;
+		}
+		if(s_block->j_blocks > 0){
+			jnl_replay();
+		}
+		if(bitmap_init(&ino_bmap, s_block->i_bitmap_blk, s_block->max_inum, 1) < 0 ||
+				bitmap_init(&blk_bmap, s_block->d_bitmap_blk, s_block->max_dnum, 1) < 0 ||
+				groups_init() < 0){
+			return -EIO;
+		}
+	}
+	// Step 1c: From here on metadata only reaches the disk through the journal,
+	// so a transaction has to fit in both the journal and the block cache
+	journal_on = s_block->j_blocks > 0;
+	if(journal_on){
+		int cap = jnl_capacity(), cache = bio_cache_blocks();
+		txn_limit = (cap < cache ? cap : cache) - (ino_bmap.nblocks + blk_bmap.nblocks);
+		if(txn_limit < txn_data_credits(WRITE_CHUNK)){
+			journal_on = 0;
+			bitmap_release(&ino_bmap);
+			bitmap_release(&blk_bmap);
+			groups_release();
+			free(s_block);
+			s_block = NULL;
+			dev_close();
+			return -EINVAL;
+		}
 	}
+	bio_journal_config(journal_on);
+	TRACE(TRACE_INFO, TR_MOUNT, s_block->i_start_blk, s_block->d_start_blk, s_block->j_blocks);
   // Step 1b: If disk file is found, just initialize in-memory data structures
   // and read superblock from disk
 
-	pthread_mutex_unlock(&lock);
-	return NULL;
+	return 0;
 }
 
-static void tfs_destroy(void *userdata) {
+int tfs_unmount() {
 
-	pthread_mutex_lock(&lock);
-	// Step 1: De-allocate in-memory data structures
+	// Step 1: Write back and de-allocate in-memory data structures
+	int ret = writeback_all();
+	if(journal_on){
+		//commit what is left, make it durable at home and empty the journal
+		ret |= jnl_commit();
+		ret |= bio_sync();
+		ret |= jnl_clear();
+	}
+	dcache_release();
+	sync_inodes();
+	icache_release();
+	bitmap_sync(&ino_bmap);
+	bitmap_sync(&blk_bmap);
+	bitmap_release(&ino_bmap);
+	bitmap_release(&blk_bmap);
+	groups_release();
 	if(s_block != NULL){free(s_block);}
-	// Step 2: Close diskfile
-	printf("TOTAL BLOCKS USED: %d", total_blocks_used);
-	dev_close(diskfile_path);
-	pthread_mutex_unlock(&lock);
+	// Step 2: Write back cached blocks and close diskfile
+	ret |= bio_flush();
+	dev_close();
+	TRACE(TRACE_INFO, TR_UNMOUNT, total_blocks_used, ret, 0);
+	trace_close();
+	return ret < 0 ? -EIO : 0;
 }
 
-static int tfs_getattr(const char *path, struct stat *stbuf) {
+//Attributes of inode, for getattr and for the entries readdir hands out
+static void fill_stat(const struct inode *inode, struct stat *stbuf) {
+	if(inode->type == _FILE_){
+		stbuf->st_mode   = S_IFREG | 0777;
+	}else if(inode->type == _DIRECTORY_){
+		stbuf->st_mode = S_IFDIR | 0755;
+	}
+	time(&stbuf->st_mtime);
+	stbuf->st_nlink  = 2;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_ino = inode->ino;
+	stbuf->st_size = inode->size;
+}
 
-	pthread_mutex_lock(&lock);
-	printf("testing get node by path at least: %s\n", path);
+int tfs_getattr(const char *path, struct stat *stbuf) {
 
 	// Step 1: call get_node_by_path() to get inode from path
-	struct inode* temp_inode = malloc(sizeof(struct inode));
-	int ret = get_node_by_path(path, 0, temp_inode);
-	if(ret ==-1){
-		printf("failure: super block test: %d\n", s_block->i_start_blk);
-		pthread_mutex_unlock(&lock);
+	// (the copy comes out of the inode cache in one piece, no inode lock needed)
+	struct inode inode;
+	int ret = get_node_by_path(path, 0, &inode);
+	if(ret == -1){
 		return -ENOENT;
 	}
-	readi(ret, temp_inode);
 	// Step 2: fill attribute of file into stbuf from inode
-	if(temp_inode->type == _FILE_){
-		stbuf->st_mode   = S_IFREG | 0777;
-	}else if(temp_inode->type == _DIRECTORY_){
-		//stbuf->st_nlink  = 2;
-		stbuf->st_mode = S_IFDIR | 0755;
+	fill_stat(&inode, stbuf);
+	return 0;
+}
+
+/*
+ * Open directory state, the handle tfs_opendir() gives out. It pins the
+ * directory's cached inode, so readdir calls don't walk the path again,
+ * and keeps a copy of the leaf block the last call stopped in. The
+ * offsets readdir hands to filler are lblk*BLOCK_SIZE plus the offset of
+ * the next record in that leaf (0 is the start). A call that resumes
+ * inside the copied leaf goes on from the copy, so records compacted
+ * away between calls are neither skipped nor listed twice; any other
+ * leaf is read again and resumes at the first record at or past the
+ * offset. The pinned entry's generation is noted at open, so a cursor
+ * whose directory was removed lists nothing, even once the inode number
+ * is reused.
+ */
+struct dir_cursor {
+	uint32_t			ino;
+	struct cached_inode	*ci;
+	uint32_t			gen;	/* ci->gen when opened */
+	int32_t				lblk;	/* leaf holds a copy of this block, -1 for none */
+	struct dir_leaf		*leaf;
+};
+
+static struct dir_cursor *dir_cursor_new(uint32_t ino) {
+	struct cached_inode *ci = iget(ino);
+	if(ci == NULL){
+		return NULL;
 	}
-		time(&stbuf->st_mtime);
-		stbuf->st_nlink  = 2;
-		stbuf->st_uid = getuid();
-		stbuf->st_gid = getgid();
-		stbuf->st_ino = temp_inode->ino;
-		stbuf->st_size = temp_inode->size;
-		//stbuf->st_blocks = temp_inode->size/BLOCK_SIZE;
-	char * temp__ = malloc(sizeof(char));
-	free(temp__);
-	free(temp_inode);
-	printf("still ok after getattr\n");	
+	struct dir_cursor *dc = calloc(1, sizeof(struct dir_cursor));
+	dc->ino = ino;
+	dc->ci = ci;
+	dc->gen = ci->gen;
+	dc->lblk = -1;
+	dc->leaf = malloc(BLOCK_SIZE);
+	return dc;
+}
 
-	pthread_mutex_unlock(&lock);
-	return 0;
+static void dir_cursor_free(struct dir_cursor *dc) {
+	if(dc == NULL){
+		return;
+	}
+	iput(dc->ci);
+	free(dc->leaf);
+	free(dc);
 }
 
-static int tfs_opendir(const char *path, struct fuse_file_info *fi) {
+int tfs_opendir(const char *path, struct dir_cursor **dc) {
 
-    pthread_mutex_lock(&lock);
     struct inode inode;
     int ret =  get_node_by_path(path, 0, &inode);
     if (ret == -1){
-	    pthread_mutex_unlock(&lock);
-	    return ret;
+	    return -ENOENT;
+    }
+    if (inode.type != _DIRECTORY_){
+	    return -ENOTDIR;
+    }
+    if (dc != NULL){
+	    *dc = dir_cursor_new(ret);
     }
-
-    pthread_mutex_unlock(&lock);
     return 0;
 
 }
 
-static int tfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-   // buffer = malloc(BLOCK_SIZE);
-    // Step 1: Call get_node_by_path() to get inode from path
-
-    pthread_mutex_lock(&lock);
-    struct inode *inode = malloc(sizeof (struct inode));
-    int exists = get_node_by_path(path, 0, inode);
-    if (exists == -1){
-	pthread_mutex_unlock(&lock);
-        return -1;
-    }
-    printf("does exist\n");
-    readi(exists, inode);
-    // Step 2: Read directory entries from its data blocks, and copy them to filler
-   
-	for (int i = 0; i < 16; i++) {
-		if (inode->direct_ptr[i] > -1) {
-			printf("block to read from on iteration %d: %d\n", i, inode->direct_ptr[i]);
-			struct dirent* dirent = (struct dirent*) malloc(sizeof(struct dirent));
-			char* temp_buffer = malloc(BLOCK_SIZE);
-			bio_read(s_block->d_start_blk + inode->direct_ptr[i], temp_buffer);
-			int j, dirents_per_block;
-			dirents_per_block = BLOCK_SIZE/sizeof(struct dirent);
-			for(j=0; j < dirents_per_block; j++){
-				memcpy(dirent, &temp_buffer[j*sizeof(struct dirent)], sizeof(struct dirent));
-				if(dirent->valid == 1){
-					printf("here is the name: -%s-\n", dirent->name);
-					char* temp = malloc(sizeof(char)*(strlen(dirent->name)+1));
-					memcpy(temp, dirent->name, strlen(dirent->name));
-					temp[strlen(dirent->name)] = '\0';
-					struct stat* stbuf = malloc(sizeof(struct stat));
-					filler(buffer, dirent->name, NULL,  0);
-					free(temp);
-				}
+/*
+ * List dc's directory from offset on, one pass over its leaf blocks, until
+ * the records run out or filler says its buffer is full.
+ */
+static int dir_list(struct dir_cursor *dc, void *buffer, tfs_fill_dir_t filler, off_t offset) {
+	struct inode inode, child;
+	struct stat st;
+	char name[256];
+	pthread_rwlock_rdlock(&dc->ci->rwlock);
+	readi(dc->ino, &inode);
+	//removed since it was opened: nothing left to list
+	if(dc->gen != dc->ci->gen || !inode.valid || inode.type != _DIRECTORY_){
+		pthread_rwlock_unlock(&dc->ci->rwlock);
+		return 0;
+	}
+	uint32_t lblk = offset/BLOCK_SIZE;
+	int off = offset%BLOCK_SIZE, full = 0;
+	for(; !full && lblk < inode.size/BLOCK_SIZE; lblk++, off = 0){
+		if(lblk == 0 && (inode.flags & INODE_FL_INDEX)){
+			continue;
+		}
+		if(off == 0 || dc->lblk != (int32_t)lblk){
+			int blkno = bmap(&inode, lblk, NULL);
+			if(blkno < 0){
+				continue;
+			}
+			bio_read(data_block(blkno), dc->leaf);
+			dc->lblk = lblk;
+		}
+		struct dir_leaf *leaf = dc->leaf;
+		int at = 0;
+		while(at < leaf->used && at < off){
+			at += DIR_REC_LEN(leaf_rec(leaf, at)->name_len);
+		}
+		while(at < leaf->used){
+			struct dir_rec *r = leaf_rec(leaf, at);
+			at += DIR_REC_LEN(r->name_len);
+			memcpy(name, r->name, r->name_len);
+			name[r->name_len] = '\0';
+			memset(&st, 0, sizeof(st));
+			if(readi(r->ino, &child) == 0){
+				fill_stat(&child, &st);
+			}else{
+				st.st_ino = r->ino;
+			}
+			if(filler(buffer, name, &st, (off_t)lblk*BLOCK_SIZE + at)){
+				full = 1;
+				break;
 			}
-			free(temp_buffer);
-			free(dirent);
 		}
 	}
-    pthread_mutex_unlock(&lock);
-    return 0;
+	pthread_rwlock_unlock(&dc->ci->rwlock);
+	return 0;
+}
+
+int tfs_readdir(const char *path, void *buffer, tfs_fill_dir_t filler, off_t offset, struct dir_cursor *dc) {
+	if(dc != NULL){
+		return dir_list(dc, buffer, filler, offset);
+	}
+	// No handle: Call get_node_by_path() to get inode from path, and list through a cursor of our own
+	struct inode inode;
+	int exists = get_node_by_path(path, 0, &inode);
+	if (exists == -1){
+		return -ENOENT;
+	}
+	if (inode.type != _DIRECTORY_){
+		return -ENOTDIR;
+	}
+	dc = dir_cursor_new(exists);
+	if (dc == NULL){
+		return -EIO;
+	}
+	int ret = dir_list(dc, buffer, filler, offset);
+	dir_cursor_free(dc);
+	return ret;
+}
+
+
+/*
+ * Split path into a freshly allocated parent path and name (dirname() and
+ * basename() modify their arguments). Free both with free(*copy).
+ */
+static void split_path(const char *path, char **copy, char **parent, char **name) {
+	size_t len = strlen(path);
+	char *buf = malloc(2*(len+1));
+	memcpy(buf, path, len+1);
+	memcpy(buf+len+1, path, len+1);
+	*copy = buf;
+	*parent = dirname(buf);
+	*name = basename(buf+len+1);
 }
 
+/*
+ * Create a new inode of the given type and link it into its parent
+ * directory. Only the parent is locked (exclusively); the new inode is
+ * fully written before dir_add() makes it visible.
+ */
+static int tfs_new_node(const char *path, int type) {
+    // Step 1: Use dirname() and basename() to separate parent directory path and target name
+    char *copy, *parent_name, *target_name;
+    split_path(path, &copy, &parent_name, &target_name);
 
-static int tfs_mkdir(const char *path, mode_t mode) {
-    // Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-    
-    pthread_mutex_lock(&lock);
-    char* parent_path = malloc(sizeof(char)*(strlen(path)+1));
-    char* target_path = malloc(sizeof(char)*(strlen(path)+1));
-    memcpy(parent_path, path, strlen(path));
-    memcpy(target_path, path, strlen(path));
-    parent_path[strlen(path)] = '\0';
-    target_path[strlen(path)]='\0';
-    char* parent_name = dirname(parent_path);
-    char* target_name = basename(target_path);
-    printf("parent name: %s\n", parent_path);
-    printf("target name: %s\n", target_name);
     // Step 2: Call get_node_by_path() to get inode of parent directory
-    struct inode *parent_inode = malloc(sizeof(struct inode));
-    int exists = get_node_by_path(parent_name, 0, parent_inode);
-	printf("EXISTS??: %d\n", exists);
-    if (exists == -1) {
-		printf("ERROR: parent directory does not exist\n");
-		free(parent_path);
-		free(target_path);
-		pthread_mutex_unlock(&lock);
-		return -1;
+    struct inode parent_inode;
+    int parent_ino = get_node_by_path(parent_name, 0, &parent_inode);
+    if (parent_ino == -1) {
+		free(copy);
+		return -ENOENT;
+	}
+    struct cached_inode *parent = ilock(parent_ino, 1);
+    if (parent == NULL) {
+		free(copy);
+		return -EIO;
+	}
+    readi(parent_ino, &parent_inode);
+    struct dirent dirent;
+    if (parent_inode.valid != 1 || parent_inode.type != _DIRECTORY_) {
+		iunlock(parent);
+		free(copy);
+		return -ENOTDIR;
+	}
+    if (dir_find(parent_ino, target_name, strlen(target_name), &dirent) > 0) {
+		iunlock(parent);
+		free(copy);
+		return -EEXIST;
 	}
 
-    readi(exists, parent_inode);
     // Step 3: Call get_avail_ino() to get an available inode number
-    int target_ino = get_avail_ino();
+    int target_ino = get_avail_ino(parent_ino, type == _DIRECTORY_);
+    if (target_ino < 0) {
+		iunlock(parent);
+		free(copy);
+		return -ENOSPC;
+	}
 
-    // Step 4: Call dir_add() to add directory entry of target directory to parent directory
+    // Step 4: Update inode for target. It gets no data blocks yet: files
+    // start out inline, directories get their first block from dir_add()
     struct inode target_inode;
-	dir_add(*parent_inode, target_ino, target_name, strlen(target_name));
-
-    // Step 5: Update inode for target directory
-    // struct dirent target_dirent;
-    // target_dirent.ino = target_ino;
-    // target_dirent.valid = 0;
-    // memcpy(target_dirent.name, target_name, strlen(target_name));
-    // target_dirent.len = strlen(target_name);
-
+    memset(&target_inode, 0, sizeof(struct inode));
     target_inode.ino = target_ino;
     target_inode.valid = 1;
-    target_inode.size = 4096;
-    target_inode.type = _DIRECTORY_;
+    target_inode.size = 0;
+    target_inode.type = type;
+    target_inode.flags = type == _DIRECTORY_ ? 0 : INODE_FL_INLINE;
     target_inode.link = 2;
-    int i;
-    for (i = 0; i < 16; i++) {
-        target_inode.direct_ptr[i] = -1;
-    }
-
-    int avail_data = get_avail_blkno();
-    target_inode.direct_ptr[0] = avail_data;
-    struct dirent temp_dirent;
-    temp_dirent.valid = 0;
-    char* data_buffer = malloc(BLOCK_SIZE);
-    for(i = 0; i < BLOCK_SIZE/sizeof(struct dirent); i++){
-	memcpy(&data_buffer[sizeof(struct dirent)*i], &temp_dirent, sizeof(struct dirent));
-    }
-
-    free(data_buffer);
+    if (type == _DIRECTORY_) {
+		ext_init(&target_inode);
+	}
 
-    // Step 6: Call writei() to write inode to disk
+    // Step 5: Call writei() to write inode to disk
     writei(target_ino, &target_inode);
-	printf("FINISHED MKDIR\n");
-    pthread_mutex_unlock(&lock);
-    return 0;
-}
-
-static int tfs_rmdir(const char *path) {
-
-    // Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-    
-    pthread_mutex_lock(&lock);
-    char* parent_path = malloc(sizeof(char)*(strlen(path)+1));
-    char* target_path = malloc(sizeof(char)*(strlen(path)+1));
-    memcpy(parent_path, path, strlen(path));
-    memcpy(target_path, path, strlen(path));
-    parent_path[strlen(path)] = '\0';
-    target_path[strlen(path)]='\0';
-    char* parent_name = dirname(parent_path);
-    char* target_name = basename(target_path);
-    printf("parent name: %s\n", parent_path);
-    printf("target name: %s\n", target_name);
-
-    // Step 2: Call get_node_by_path() to get inode of target directory
-    struct inode target_inode;
-    int target_ino = get_node_by_path(path, 0, &target_inode);
-	if (target_ino == -1) {
-		printf("ERROR: target directory does not exist");
-		free(parent_path);
-		free(target_path);
-		pthread_mutex_unlock(&lock);
-		return -1;
-	}
-	readi(target_ino, &target_inode);
 
-    // Step 3: Clear data block bitmap of target directory
-    bitmap_t data_bitmap = malloc(MAX_DNUM/8);
-    void* data_buffer = malloc(BLOCK_SIZE);
-    bio_read(s_block->d_bitmap_blk, data_buffer);
-    memcpy(data_bitmap, data_buffer, s_block->max_dnum/8);
-    for (int i = 0; i < 16; i++) {
-		if (target_inode.direct_ptr[i] != -1) {
-			unset_bitmap(data_bitmap, target_inode.direct_ptr[i]);
-		}
+    // Step 6: Call dir_add() to add directory entry of target to parent directory
+    int ret = dir_add(parent_inode, target_ino, target_name, strlen(target_name));
+    TRACE(TRACE_DEBUG, TR_NEW_NODE, parent_ino, ret < 0 ? -1 : target_ino, type);
+    if (ret < 0) {
+		target_inode.valid = 0;
+		bmap_free(&target_inode);
+		writei(target_ino, &target_inode);
+		release_ino(target_ino);
 	}
-	bio_write(s_block->d_bitmap_blk, (const void *)data_bitmap);
-	free(data_bitmap);
-	free(data_buffer);
-    
-
-    // Step 4: Clear inode bitmap and its data block
-    bitmap_t inode_bitmap = malloc(sizeof(char)*MAX_INUM/8);
-    void* inode_buffer = malloc(BLOCK_SIZE);
-    bio_read(s_block->i_bitmap_blk, inode_buffer);
-    memcpy(inode_bitmap, inode_buffer, s_block->max_inum/8);
-    unset_bitmap(inode_bitmap, target_inode.ino);
-    bio_write(s_block->i_bitmap_blk, (const void *)inode_bitmap);
-	free(inode_bitmap);
-	free(inode_buffer);
+    iunlock(parent);
+    free(copy);
+    return ret < 0 ? -ENOSPC : 0;
+}
 
+/*
+ * Unlink a file or (empty) directory. Locks the parent, then the target.
+ */
+static int tfs_remove_node(const char *path, int type) {
+    // Step 1: Use dirname() and basename() to separate parent directory path and target name
+    char *copy, *parent_name, *target_name;
+    split_path(path, &copy, &parent_name, &target_name);
 
-    // Step 5: Call get_node_by_path() to get inode of parent directory
+    // Step 2: Call get_node_by_path() to get inode of parent directory and lock it
     struct inode parent_inode;
     int parent_ino = get_node_by_path(parent_name, 0, &parent_inode);
-	if (parent_ino == -1) {
-		printf("ERROR: parent directory does not exist");
-		free(parent_path);
-		free(target_path);
-		pthread_mutex_unlock(&lock);
-		return -1;
+    if (parent_ino == -1) {
+		free(copy);
+		return -ENOENT;
 	}
-	readi(parent_ino, &parent_inode);
+    struct cached_inode *parent = ilock(parent_ino, 1);
+    if (parent == NULL) {
+		free(copy);
+		return -EIO;
+	}
+    readi(parent_ino, &parent_inode);
 
-    // Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
-    dir_remove(parent_inode, target_name, strlen(target_name));
+    // Step 3: Find the target in its parent (under the parent's lock) and lock it
+    struct dirent dirent;
+    if (dir_find(parent_ino, target_name, strlen(target_name), &dirent) < 0) {
+		iunlock(parent);
+		free(copy);
+		return -ENOENT;
+	}
+    struct cached_inode *target = ilock(dirent.ino, 1);
+    if (target == NULL) {
+		iunlock(parent);
+		free(copy);
+		return -EIO;
+	}
+    struct inode target_inode;
+    readi(dirent.ino, &target_inode);
+    if (target_inode.type != type) {
+		iunlock(target);
+		iunlock(parent);
+		free(copy);
+		return type == _DIRECTORY_ ? -ENOTDIR : -EISDIR;
+	}
 
-	free(parent_path);
-	free(target_path);
-    //free(inode_buffer);
-//	free(data_buffer);
-	pthread_mutex_unlock(&lock);
+    // Step 4: Call dir_remove() to remove directory entry of target in its parent directory
+    dir_remove(parent_inode, target_name, strlen(target_name));
+    TRACE(TRACE_DEBUG, TR_REMOVE_NODE, parent_ino, target_inode.ino, type);
+    dcache_forget_dir(target_inode.ino);
+
+    // Step 5: Clear data block bitmap of target (and drop unwritten data)
+    dirty_drop(target, target->ndirty);
+    bmap_free(&target_inode);
+
+    // Step 6: Clear inode bitmap and its data block
+    target_inode.valid = 0;
+    writei(target_inode.ino, &target_inode);
+    target->gen++;
+    release_ino(target_inode.ino);
+
+    iunlock(target);
+    iunlock(parent);
+    free(copy);
     return 0;
 }
 
+int tfs_mkdir(const char *path, mode_t mode) {
+	if(txn_begin() < 0){
+		return -EIO;
+	}
+	int ret = tfs_new_node(path, _DIRECTORY_);
+	txn_end();
+	return ret;
+}
 
-static int tfs_releasedir(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
+int tfs_rmdir(const char *path) {
+	if(txn_begin() < 0){
+		return -EIO;
+	}
+	int ret = tfs_remove_node(path, _DIRECTORY_);
+	txn_end();
+	return ret;
+}
+
+
+int tfs_releasedir(const char *path, struct dir_cursor *dc) {
+	dir_cursor_free(dc);
 	return 0;
 }
 
 
 
 
-static int tfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-	pthread_mutex_lock(&lock);
-	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
-	//char* dir = malloc(sizeof(char)*10);
-	char *dir, *base, *dir_name, *base_name;
-	//dirname and basename modify their arguments so need to duplicate string
-	printf("-------duplicating path %s------------\n", path);
-	int length = strlen(path);
-//	printf("it's not calling strlen\n");
-	dir = malloc(sizeof(char)*(strlen(path)+1));
-//	printf("it's not the frist malloc at least\n");
-	base = malloc(sizeof(char)*(strlen(path)+1));
-//	printf("it's not the second malloc at least\n");
-	memcpy(dir, path, strlen(path));
-//	printf("it's not the frist malloc at least\n");
-	memcpy(base, path, strlen(path));
-	dir[strlen(path)] = '\0';
-	base[strlen(path)] = '\0';
-	dir_name = dirname(dir);
-	printf("dir_name: %s\n", dir_name);
-	base_name = basename(base);
-	printf("base_name: %s\n", base_name);
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode* inode = malloc(sizeof(struct inode)); 
-	printf("-------------getting inode of parent directory by path--------\n");
-	int dir_ino = get_node_by_path(dir_name, 0, inode);
-	printf("inode is %d\n", dir_ino);
-	if(dir_ino <0){
-		printf("didn't find it\n");
-		pthread_mutex_unlock(&lock);
-		return -1;
-	}else{
-		readi(dir_ino, inode);
-	}
-	// Step 3: Call get_avail_ino() to get an available inode number
-	printf("------------getting available ino:------------\n");
-	int avail_ino = get_avail_ino();
-	printf("first available inode was %d\n", avail_ino);
-	// Step 4: Call dir_add() to add directory entry of target file to parent directory
-	struct inode *new_node = malloc(sizeof(struct inode));
-	printf("-----------calling dir_add---------\n");
-	int found = dir_add(*inode, avail_ino, base_name, strlen(base_name));
-	if(found <0){
-		printf("can't add a duplicate file!!!\n");
-		pthread_mutex_unlock(&lock);
-		return -ENOENT;
+/*
+ * Per open file state, the handle tfs_open()/tfs_create() give out. It pins the cached inode (so
+ * data_gen stays meaningful) and holds the readahead window: when reads
+ * keep continuing where the last one stopped, each refill of ra_buf reads
+ * the request plus window blocks ahead, and the window doubles up to
+ * RA_MAX_BLOCKS. A read anywhere else drops the window back to 0, which
+ * reads only what was asked for. ra_buf is thrown away whenever the
+ * file's data_gen moves on.
+ */
+#define RA_MIN_BLOCKS 4
+#define RA_MAX_BLOCKS 256
+
+struct open_file {
+	uint32_t			ino;
+	struct cached_inode	*ci;
+	pthread_mutex_t		lock;
+	off_t				next_off;	/* where a sequential read would continue */
+	uint32_t			window;		/* readahead window in blocks */
+	uint32_t			ra_start;	/* blocks [ra_start, ra_start+ra_count) are in ra_buf */
+	uint32_t			ra_count;
+	uint32_t			ra_cap;		/* size of ra_buf in blocks */
+	uint32_t			ra_gen;		/* data_gen ra_buf was read at */
+	char				*ra_buf;
+};
+
+static struct open_file *open_file_new(uint32_t ino) {
+	struct cached_inode *ci = iget(ino);
+	if(ci == NULL){
+		return NULL;
 	}
-	// Step 5: Update inode for target file
-	new_node->ino = avail_ino;
-	new_node->valid = 1;
-	new_node->size = 4096;
-	new_node->type = _FILE_;
-	new_node->link = 2;
-	int i;
-	for(i = 0; i < 16;i++){
-		new_node->direct_ptr[i] = -1;
+	struct open_file *of = calloc(1, sizeof(struct open_file));
+	of->ino = ino;
+	of->ci = ci;
+	pthread_mutex_init(&of->lock, NULL);
+	return of;
+}
+
+static void open_file_free(struct open_file *of) {
+	if(of == NULL){
+		return;
 	}
-	int avail_block = get_avail_blkno();
-	char* buffer = malloc(BLOCK_SIZE);
-	bio_read(s_block->i_bitmap_blk, buffer);
-	set_bitmap((bitmap_t)buffer, avail_ino);
-	bio_read(s_block->d_bitmap_blk, buffer);
-	set_bitmap((bitmap_t)buffer, avail_block);
-	new_node->direct_ptr[0] = get_avail_blkno();
-	// need to update vstat too
-	// Step 6: Call writei() to write inode to disk
-	printf("------------INODE CHECKS----------\n");
-	writei(avail_ino, new_node);
-	free(new_node);
-	new_node = malloc(sizeof(struct inode));
-	readi(avail_ino, new_node);
-	printf("Inode should be %d. it is %d\n", avail_ino, new_node->ino);
-	printf("This inode should be valid. its validity is: %d\n", new_node->valid);
-	printf("This inode should be have a size of 4096. it is %d\n", new_node->size);
-	printf("This inode should have a link count of 2. it is %d\n", new_node->link);
-	printf("This inode should only have one valid direct ptr. they are: ");
-	int z;
-	for(z = 0; z < 16; z++){
-		printf("ptr %d: %d\n", z, new_node->direct_ptr[z]);
+	iput(of->ci);
+	pthread_mutex_destroy(&of->lock);
+	free(of->ra_buf);
+	free(of);
+}
+
+int tfs_create(const char *path, mode_t mode, struct open_file **of) {
+	if(txn_begin() < 0){
+		return -EIO;
 	}
-	free(buffer);
-	free(new_node);
-	pthread_mutex_unlock(&lock);
-	return 0;
+	int ret = tfs_new_node(path, _FILE_);
+	txn_end();
+	struct inode inode;
+	if(ret == 0 && of != NULL){
+		int ino = get_node_by_path(path, 0, &inode);
+		*of = ino == -1 ? NULL : open_file_new(ino);
+	}
+	return ret;
 }
 
-static int tfs_open(const char *path, struct fuse_file_info *fi) {
-	pthread_mutex_lock(&lock);
+int tfs_open(const char *path, struct open_file **of) {
 	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode* temp_inode = malloc(sizeof(struct inode));
-	int ret = get_node_by_path(path, 0, temp_inode);
-	free(temp_inode);
+	struct inode inode;
+	int ret = get_node_by_path(path, 0, &inode);
+	// Step 2: If not find, return -1
 	if(ret ==-1){
-		printf("failure: couldn't find inode\n");
-		pthread_mutex_unlock(&lock);
-		return ret;
+		return -ENOENT;
 	}
-	// Step 2: If not find, return -1
-	pthread_mutex_unlock(&lock);
+	// Step 3: Hand out per open file state (readahead)
+	*of = open_file_new(ret);
 	return 0;
 }
 
-static int tfs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-
-	// Step 1: You could call get_node_by_path() to get inode from path
-	pthread_mutex_lock(&lock);
-	struct inode* temp_inode = malloc(sizeof(struct inode));
-	int ret = get_node_by_path(path, 0, temp_inode);
-	if(ret ==-1){
-		free(temp_inode);
-		printf("failure: couldn't find inode\n");
-		pthread_mutex_unlock(&lock);
-		return ret;
-	}
-	free(temp_inode);
-	// Step 2: Based on size and offset, read its data blocks from disk
-	int start_block = offset/BLOCK_SIZE;
-	int num_blocks = size/BLOCK_SIZE;
-	if((size)%BLOCK_SIZE!=0){
-		num_blocks++;
-	}
-	printf("size: %ld, offset: %ld \n NUMBER OF BLOCKS BEING READ: %d STARTING AT: %d\n", size, offset, num_blocks, start_block);
-	int end_block = num_blocks+start_block;
-	int i, bytes_read = 0;
-	// Step 3: copy the correct amount of data from offset to buffer
-	for(i = start_block; i < end_block;i++){
-		char* temp_buffer = malloc(BLOCK_SIZE);
-		bio_read(s_block->d_start_blk+temp_inode->direct_ptr[i], temp_buffer);
-		if(i == start_block){
-			memcpy(buffer,temp_buffer+(offset%BLOCK_SIZE), BLOCK_SIZE-(offset%BLOCK_SIZE));
-		       	bytes_read += BLOCK_SIZE-(offset%BLOCK_SIZE);	
-		}else if(size-bytes_read>=BLOCK_SIZE){
-			memcpy(buffer+bytes_read, temp_buffer, BLOCK_SIZE);
-			bytes_read+=BLOCK_SIZE;
-		}else{
-			memcpy(buffer+bytes_read, temp_buffer, size-bytes_read);
-			bytes_read+=(size-bytes_read);
+/*
+ * List the data blocks behind bytes [offset, offset+size) of a file for
+ * bio_readv/bio_writev. Blocks the range covers completely point straight
+ * into buf; a partially covered first or last block uses head or tail
+ * (BLOCK_SIZE scratch buffers) instead. Holes are zero-filled in buf and
+ * left out. Returns the number of blocks listed.
+ */
+static int file_blocks(struct inode *inode, char *buf, off_t offset, size_t size, char *head, char *tail, int *blocks, void **bufs) {
+	uint32_t lblk = offset/BLOCK_SIZE, last = (offset+size-1)/BLOCK_SIZE, run;
+	int n = 0;
+	while(lblk <= last){
+		int blkno = bmap(inode, lblk, &run);
+		for(; run > 0 && lblk <= last; run--, lblk++){
+			off_t start = (off_t)lblk*BLOCK_SIZE;
+			off_t from = start > offset ? start : offset;
+			off_t to = start+BLOCK_SIZE < offset+(off_t)size ? start+BLOCK_SIZE : offset+(off_t)size;
+			if(blkno < 0){
+				memset(buf+(from-offset), 0, to-from);
+				continue;
+			}
+			if(to-from == BLOCK_SIZE){
+				bufs[n] = buf+(start-offset);
+			}else{
+				bufs[n] = start <= offset ? head : tail;
+			}
+			blocks[n++] = data_block(blkno++);
 		}
-		free(temp_buffer);
 	}
+	return n;
+}
 
-	// Note: this function should return the amount of bytes you copied to buffer
-	pthread_mutex_unlock(&lock);
-	return bytes_read;
+/*
+ * Read bytes [offset, offset+size) of a file, which must lie within its
+ * size, with one bio_readv.
+ */
+static int file_read(struct inode *inode, char *buffer, size_t size, off_t offset) {
+	uint32_t first = offset/BLOCK_SIZE, last = (offset+size-1)/BLOCK_SIZE;
+	int ret = size;
+	int *blocks = malloc(sizeof(int)*(last-first+1));
+	void **bufs = malloc(sizeof(void*)*(last-first+1));
+	char *head = calloc(2, BLOCK_SIZE), *tail = head+BLOCK_SIZE;
+	int n = file_blocks(inode, buffer, offset, size, head, tail, blocks, bufs);
+	if(n > 0 && bio_readv(blocks, bufs, n) < 0){
+		ret = -EIO;
+	}else{
+		//copy the partial blocks at either end into buffer
+		if(offset%BLOCK_SIZE != 0 || (first == last && (offset+size)%BLOCK_SIZE != 0)){
+			size_t in_head = BLOCK_SIZE-offset%BLOCK_SIZE < size ? BLOCK_SIZE-offset%BLOCK_SIZE : size;
+			memcpy(buffer, head+offset%BLOCK_SIZE, in_head);
+		}
+		if(last > first && (offset+size)%BLOCK_SIZE != 0){
+			size_t in_tail = (offset+size)-(off_t)last*BLOCK_SIZE;
+			memcpy(buffer+size-in_tail, tail, in_tail);
+		}
+	}
+	free(head);
+	free(bufs);
+	free(blocks);
+	return ret;
 }
 
-static int tfs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	pthread_mutex_lock(&lock);
+/*
+ * file_read() through of's readahead buffer. The caller holds the inode
+ * lock (shared), so data_gen can't change underneath.
+ */
+static int ra_read(struct open_file *of, struct inode *inode, char *buffer, size_t size, off_t offset) {
+	uint32_t first = offset/BLOCK_SIZE, last = (offset+size-1)/BLOCK_SIZE;
+	int ret = size;
+	pthread_mutex_lock(&of->lock);
+	if(offset == of->next_off){
+		of->window = of->window == 0 ? RA_MIN_BLOCKS : (of->window*2 > RA_MAX_BLOCKS ? RA_MAX_BLOCKS : of->window*2);
+	}else{
+		of->window = 0;
+	}
+	of->next_off = offset+size;
+	if(of->ra_gen != of->ci->data_gen){
+		of->ra_count = 0;
+	}
+
+	if(first < of->ra_start || last >= of->ra_start+of->ra_count){
+		if(of->window == 0){
+			pthread_mutex_unlock(&of->lock);
+			return file_read(inode, buffer, size, offset);
+		}
+		//refill: the blocks asked for plus the window, up to the end of file
+		uint32_t eof = (inode->size+BLOCK_SIZE-1)/BLOCK_SIZE;
+		uint32_t count = last-first+1+of->window;
+		if(first+count > eof){
+			count = eof-first;
+		}
+		if(count > of->ra_cap){
+			free(of->ra_buf);
+			of->ra_buf = malloc((size_t)count*BLOCK_SIZE);
+			of->ra_cap = count;
+		}
+		of->ra_count = 0;
+		if(file_read(inode, of->ra_buf, (size_t)count*BLOCK_SIZE, (off_t)first*BLOCK_SIZE) < 0){
+			pthread_mutex_unlock(&of->lock);
+			return -EIO;
+		}
+		of->ra_start = first;
+		of->ra_count = count;
+		of->ra_gen = of->ci->data_gen;
+	}
+	memcpy(buffer, of->ra_buf+(offset-(off_t)of->ra_start*BLOCK_SIZE), size);
+	pthread_mutex_unlock(&of->lock);
+	return ret;
+}
 
+int tfs_read(const char *path, char *buffer, size_t size, off_t offset, struct open_file *of) {
 
 	// Step 1: You could call get_node_by_path() to get inode from path
-	struct inode* temp_inode = malloc(sizeof(struct inode));
-	int ret = get_node_by_path(path, 0, temp_inode);
+	struct inode inode;
+	int ret = get_node_by_path(path, 0, &inode);
 	if(ret ==-1){
-		free(temp_inode);
-		printf("failure: couldn't find inode\n");
-		pthread_mutex_unlock(&lock);
-		return ret;
+		return -ENOENT;
 	}
+	TRACE(TRACE_DEBUG, TR_READ, ret, offset, size);
+	struct cached_inode *ci = ilock(ret, 0);
+	if(ci == NULL){
+		return -EIO;
+	}
+	readi(ret, &inode);
 	// Step 2: Based on size and offset, read its data blocks from disk
-	//char * temp_read_buffer = malloc(size);
-	int start_block = offset/BLOCK_SIZE;
-	int num_blocks = temp_inode->size/BLOCK_SIZE;
-	if((temp_inode->size)%BLOCK_SIZE!=0){
-		num_blocks++;
-	}
-	int i, bytes_written = 0;
-	for(i = start_block; i < num_blocks;i++){
-		char* temp_buffer = malloc(BLOCK_SIZE);
-		bio_read(s_block->d_start_blk+temp_inode->direct_ptr[i], temp_buffer);
-		if(i == start_block){
-			memcpy(temp_buffer+(offset%BLOCK_SIZE), buffer,BLOCK_SIZE-(offset%BLOCK_SIZE));
-			bio_write(s_block->d_start_blk+temp_inode->direct_ptr[i], temp_buffer);
-		       	bytes_written += BLOCK_SIZE-(offset%BLOCK_SIZE);	
-		}else if(size-bytes_written>=BLOCK_SIZE){
-			memcpy(temp_buffer+bytes_written, buffer, BLOCK_SIZE);
-			bytes_written+=BLOCK_SIZE;
-			bio_write(s_block->d_start_blk+temp_inode->direct_ptr[i], temp_buffer);
-		}else{
-			memcpy(temp_buffer+bytes_written, buffer, size-bytes_written);
-			bytes_written+=(size-bytes_written);
-			bio_write(s_block->d_start_blk+temp_inode->direct_ptr[i], temp_buffer);
-		}
-		free(temp_buffer);
+	if(offset >= inode.size || size == 0){
+		iunlock(ci);
+		return 0;
+	}
+	if(offset+size > inode.size){
+		size = inode.size-offset;
+	}
+	// Step 3: copy the correct amount of data from offset to buffer, through
+	// the open file's readahead when there is one
+	if(inode.flags & INODE_FL_INLINE){
+		memcpy(buffer, inode.inline_data+offset, size);
+		ret = size;
+	}else if(of != NULL && of->ino == ret){
+		ret = ra_read(of, &inode, buffer, size, offset);
+	}else{
+		ret = file_read(&inode, buffer, size, offset);
+	}
+	if(ret > 0 && ci->ndirty > 0){
+		dirty_overlay(ci, buffer, size, offset);
 	}
 
-	if(bytes_written < size){ // need to give more blocks
-		int num_new_blocks = (size-bytes_written)/BLOCK_SIZE;
-		if((size-bytes_written)%BLOCK_SIZE!=0){
-			num_new_blocks++;
-		}
-		for(i=0; i < num_new_blocks;i++){
-			if(i+num_blocks > 16){
-				pthread_mutex_unlock(&lock);
-				return bytes_written;
-			}else{
-				int new_block = get_avail_blkno();
-				temp_inode->direct_ptr[i+num_blocks] = new_block;
-				if(size-bytes_written >= BLOCK_SIZE ){
-					bio_write(s_block->d_start_blk+temp_inode->direct_ptr[i+num_blocks], buffer+bytes_written);
-					bytes_written+=BLOCK_SIZE;
-				}else{
-					char* temp_buffer = malloc(BLOCK_SIZE);
-					memcpy(temp_buffer, buffer+bytes_written, size-bytes_written);
-					bio_write(s_block->d_start_blk+temp_inode->direct_ptr[i+num_blocks], temp_buffer);
-					bytes_written+=(size-bytes_written);	
-					free(temp_buffer);
-				}
-
-			}
+	// Note: this function should return the amount of bytes you copied to buffer
+	iunlock(ci);
+	return ret;
+}
 
+/*
+ * Write bytes [offset, offset+size) of a file straight to disk with one
+ * bio_writev and note the blocks for fsync. The caller holds ci's lock,
+ * updates the size and writes the inode.
+ */
+static int file_write(struct cached_inode *ci, struct inode *inode, const char *buffer, size_t size, off_t offset) {
+	//map every block the write touches, allocating contiguous runs for
+	//the ones that don't exist yet
+	uint32_t first = offset/BLOCK_SIZE, last = (offset+size-1)/BLOCK_SIZE;
+	int head_partial = offset%BLOCK_SIZE != 0 || (first == last && (offset+size)%BLOCK_SIZE != 0);
+	int tail_partial = last > first && (offset+size)%BLOCK_SIZE != 0;
+	int head_new = bmap(inode, first, NULL) < 0;
+	int tail_new = bmap(inode, last, NULL) < 0;
+	int allocated = bmap_alloc(inode, first, last-first+1, &ci->rsv);
+	if(allocated != 0){
+		ci->meta_dirty = 1;
+	}
+	if(allocated < 0){
+		return -ENOSPC;
+	}
+	int *blocks = malloc(sizeof(int)*(last-first+1));
+	const void **bufs = malloc(sizeof(void*)*(last-first+1));
+	char *head = malloc(2*BLOCK_SIZE), *tail = head+BLOCK_SIZE;
+	//everything is mapped now, so buffer isn't written to
+	int n = file_blocks(inode, (char*)buffer, offset, size, head, tail, blocks, (void**)bufs);
+
+	//partially written blocks that already existed are read first (one
+	//readv for both ends); new ones and anything past the old end of file
+	//start out as zeroes
+	int rblocks[2], rn = 0;
+	void *rbufs[2];
+	if(head_partial && !head_new){
+		rblocks[rn] = blocks[0];
+		rbufs[rn++] = head;
+	}
+	if(tail_partial && !tail_new){
+		rblocks[rn] = blocks[n-1];
+		rbufs[rn++] = tail;
+	}
+	if(rn > 0){
+		bio_readv(rblocks, rbufs, rn);
+	}
+	if(head_partial){
+		off_t start = (off_t)first*BLOCK_SIZE;
+		size_t valid = head_new || inode->size <= start ? 0 : inode->size-start;
+		if(valid < BLOCK_SIZE){
+			memset(head+valid, 0, BLOCK_SIZE-valid);
 		}
+		size_t in_head = BLOCK_SIZE-offset%BLOCK_SIZE < size ? BLOCK_SIZE-offset%BLOCK_SIZE : size;
+		memcpy(head+offset%BLOCK_SIZE, buffer, in_head);
+	}
+	if(tail_partial){
+		off_t start = (off_t)last*BLOCK_SIZE;
+		size_t valid = tail_new || inode->size <= start ? 0 : inode->size-start;
+		if(valid < BLOCK_SIZE){
+			memset(tail+valid, 0, BLOCK_SIZE-valid);
+		}
+		size_t in_tail = (offset+size)-start;
+		memcpy(tail, buffer+size-in_tail, in_tail);
+	}
 
+	int ret = bio_writev(blocks, bufs, n) < 0 ? -EIO : (int)size;
+	sync_track(ci, blocks, n);
+	free(head);
+	free(bufs);
+	free(blocks);
+	return ret;
+}
 
+/*
+ * Move an inline file's data out to block 0 (a dirty page in delalloc
+ * mode), for a write that doesn't fit in the inode. The caller holds ci's
+ * lock exclusively and writes the inode.
+ */
+static int inline_spill(struct cached_inode *ci, struct inode *inode) {
+	char *data = malloc(INODE_INLINE_MAX);
+	int ret = 0;
+	memcpy(data, inode->inline_data, INODE_INLINE_MAX);
+	inode->flags &= ~INODE_FL_INLINE;
+	ext_init(inode);
+	ci->meta_dirty = 1;
+	if(inode->size > 0){
+		ret = delalloc ? dirty_write(ci, inode, data, inode->size, 0) : file_write(ci, inode, data, inode->size, 0);
 	}
-	
-	// Step 3: Write the correct amount of data from offset to disk
+	if(ret < 0){
+		//no room for the block: stay inline
+		inode->flags = (inode->flags & ~INODE_FL_EXTENTS) | INODE_FL_INLINE;
+		memcpy(inode->inline_data, data, INODE_INLINE_MAX);
+	}
+	free(data);
+	return ret < 0 ? ret : 0;
+}
 
-	// Step 4: Update the inode info and write it to disk
-	temp_inode->size = offset+bytes_written;
-	writei(temp_inode->ino, temp_inode);
-	pthread_mutex_unlock(&lock);
-	// Note: this function should return the amount of bytes you write to disk
-	return bytes_written;
-}
-
-static int tfs_unlink(const char *path) {
-	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
-	pthread_mutex_lock(&lock);
-
-
-	char* dir, *base, *dir_name, *base_name;
-	//dirname and basename modify their arguments so need to duplicate string
-	printf("-------UNLINK START------------\n");
-	dir = strdup(path);
-	base = strdup(path);
-	dir_name = dirname(dir);
-	printf("dir_name: %s\n", dir_name);
-	base_name = basename(base);
-	printf("base_name: %s\n", base_name);
-	// Step 2: Call get_node_by_path() to get inode of target file
-	struct inode *inode = malloc(sizeof(struct inode));
-	int node_num = get_node_by_path(path, 0, inode);
-	readi(node_num , inode);
-	printf("get node by path is fine.\n");
-	if(node_num < 0){
-		pthread_mutex_unlock(&lock);
-		return -1;
+/*
+ * Write [offset, offset+size) of file ino, WRITE_CHUNK blocks at most, as
+ * one transaction. Returns the bytes written or a negative errno.
+ */
+static int write_chunk(int ino, const char *buffer, size_t size, off_t offset) {
+	int credits = txn_data_credits((offset+size-1)/BLOCK_SIZE - offset/BLOCK_SIZE + 1);
+	if(txn_begin_credits(credits) < 0){
+		return -EIO;
 	}
-	// Step 3: Clear data block bitmap of target file
-	char*buffer = malloc(BLOCK_SIZE);
-	bio_read(s_block->d_bitmap_blk, buffer);
-	int i;
-	for(i=0;i < 16; i++){
-		printf("iteration: %d --- %d\n", i, inode->direct_ptr[i]);
-		if(inode->direct_ptr[i] != -1){
-			unset_bitmap((bitmap_t)buffer, inode->direct_ptr[i]);
+	struct cached_inode *ci = ilock(ino, 1);
+	if(ci == NULL){
+		txn_end_credits(credits);
+		return -EIO;
+	}
+	struct inode inode;
+	readi(ino, &inode);
+	//small files take it in the inode
+	int ret = 0;
+	if((inode.flags & INODE_FL_INLINE) && offset+size <= INODE_INLINE_MAX){
+		memcpy(inode.inline_data+offset, buffer, size);
+		ci->meta_dirty = 1;
+		ret = size;
+	}else{
+		if(inode.flags & INODE_FL_INLINE){
+			ret = inline_spill(ci, &inode);
+		}
+		if(ret == 0){
+			ret = delalloc ? dirty_write(ci, &inode, buffer, size, offset) : file_write(ci, &inode, buffer, size, offset);
 		}
 	}
-	printf("unsetting data bitmap worked\n");
-	bio_write(s_block->d_bitmap_blk, buffer);
-	free(buffer);
-	// Step 4: Clear inode bitmap and its data block
-	buffer = malloc(BLOCK_SIZE);
-	bio_read(s_block->i_bitmap_blk, buffer);
-	unset_bitmap((bitmap_t)buffer, node_num);
-	bio_write(s_block->i_bitmap_blk, buffer);
-	printf("unsetting inode bitmap worked\n");
-
-	inode->valid = 0;
-	for(i = 0; i < 16; i++){
-		inode->direct_ptr[i] = -1;
-	}
-
-
-	writei(node_num, inode);
-	printf("freed inode successfully\n");
-	free(inode);
-	inode = malloc(sizeof(struct inode));
-	// Step 5: Call get_node_by_path() to get inode of parent directory
-	int parent_node_num = get_node_by_path(dir_name, 0, inode);
-	readi(parent_node_num, inode);
-	printf("PARENT NODE NUM:%d, %d, size: %d\n", parent_node_num, inode->ino, inode->size);
-	// Step 6: Call dir_remove() to remove directory entry of target file in its parent directory
-	printf("found parent\n");
-	if(dir_remove(*inode, base_name, strlen(base_name))==-1){
-		printf("DID NOT ACTUALLY WORK!!!!!");	
-	}	
-	free(buffer);
-	printf("-------UNLINK END------------\n");
-	pthread_mutex_unlock(&lock);
-	return 0;
-
+	if(ret > 0 && offset+size > inode.size){
+		inode.size = offset+size;
+		ci->meta_dirty = 1;
+	}
+	ci->data_gen++;
+	writei(inode.ino, &inode);
+	iunlock(ci);
+	txn_end_credits(credits);
+	return ret;
 }
 
-static int tfs_truncate(const char *path, off_t size) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
-}
+int tfs_write(const char *path, const char *buffer, size_t size, off_t offset, struct open_file *of) {
 
-static int tfs_release(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-	return 0;
+	// Step 1: You could call get_node_by_path() to get inode from path
+	struct inode inode;
+	int ino = get_node_by_path(path, 0, &inode);
+	if(ino ==-1){
+		return -ENOENT;
+	}
+	if(size == 0){
+		return 0;
+	}
+	TRACE(TRACE_DEBUG, TR_WRITE, ino, offset, size);
+
+	// Step 2: Write the correct amount of data from offset to disk, or in
+	// delalloc mode just buffer it until the inode is written back, and
+	// update the inode. Each WRITE_CHUNK blocks are a transaction of their own.
+	size_t done = 0;
+	int ret = 0;
+	while(done < size){
+		size_t len = (size_t)WRITE_CHUNK*BLOCK_SIZE - (offset+done)%BLOCK_SIZE;
+		ret = write_chunk(ino, buffer+done, len < size-done ? len : size-done, offset+done);
+		if(ret < 0){
+			break;
+		}
+		done += ret;
+	}
+
+	// Step 3: Don't let delalloc pages pile up
+	if(delalloc && __atomic_load_n(&delalloc_pages, __ATOMIC_RELAXED) > DELALLOC_MAX_PAGES){
+		writeback_ino(ino);
+	}
+	// Note: this function should return the amount of bytes you write to disk
+	return done > 0 ? (int)done : ret;
 }
 
-static int tfs_flush(const char * path, struct fuse_file_info * fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+int tfs_unlink(const char *path) {
+	if(txn_begin() < 0){
+		return -EIO;
+	}
+	int ret = tfs_remove_node(path, _FILE_);
+	txn_end();
+	return ret;
 }
 
-static int tfs_utimens(const char *path, const struct timespec tv[2]) {
+int tfs_truncate(const char *path, off_t size) {
 	// For this project, you don't need to fill this function
 	// But DO NOT DELETE IT!
     return 0;
 }
 
+//Inode number of an open file, from its handle when it has one
+static int file_ino(const char *path, struct open_file *of) {
+	struct inode inode;
+	return of != NULL ? of->ino : get_node_by_path(path, 0, &inode);
+}
 
-static struct fuse_operations tfs_ope = {
-	.init		= tfs_init,
-	.destroy	= tfs_destroy,
-
-	.getattr	= tfs_getattr,
-	.readdir	= tfs_readdir,
-	.opendir	= tfs_opendir,
-	.releasedir	= tfs_releasedir,
-	.mkdir		= tfs_mkdir,
-	.rmdir		= tfs_rmdir,
-
-	.create		= tfs_create,
-	.open		= tfs_open,
-	.read 		= tfs_read,
-	.write		= tfs_write,
-	.unlink		= tfs_unlink,
+//Write back the delalloc pages of an open file
+static int writeback_file(const char *path, struct open_file *of) {
+	int ino = file_ino(path, of);
+	if(ino == -1){
+		return -ENOENT;
+	}
+	return writeback_ino(ino);
+}
 
-	.truncate   = tfs_truncate,
-	.flush      = tfs_flush,
-	.utimens    = tfs_utimens,
-	.release	= tfs_release
-};
+int tfs_release(const char *path, struct open_file *of) {
+	int ret = delalloc ? writeback_file(path, of) : 0;
+	if(of != NULL){
+		//done writing through this handle, give back the unused blocks
+		pthread_rwlock_wrlock(&of->ci->rwlock);
+		rsv_return(&of->ci->rsv);
+		pthread_rwlock_unlock(&of->ci->rwlock);
+	}
+	open_file_free(of);
+	return ret;
+}
 
+int tfs_flush(const char * path, struct open_file *of) {
+	// Write back the file's delayed allocation pages, then push dirty inodes,
+	// the bitmaps and everything sitting in the block cache out to the disk file
+	int ret = writeback_file(path, of);
+	if(ret < 0){
+		return ret;
+	}
+	if(journal_on){
+		return jnl_commit() < 0 ? -EIO : 0;
+	}
+	ret = sync_inodes();
+	ret |= bitmap_sync(&ino_bmap);
+	ret |= bitmap_sync(&blk_bmap);
+	ret |= bio_flush();
+	return ret < 0 ? -EIO : 0;
+}
 
-int main(int argc, char *argv[]) {
-	int fuse_stat;
+int tfs_fsync(const char *path, int datasync, struct open_file *of) {
+	// Step 1: Write back delalloc pages so the file's data all has blocks
+	int ret = writeback_file(path, of);
+	int ino = file_ino(path, of);
+	if(ret < 0 || ino == -1){
+		return ret < 0 ? ret : -ENOENT;
+	}
 
-	getcwd(diskfile_path, PATH_MAX);
-	strcat(diskfile_path, "/DISKFILE");
+	// Step 2: Take the file's list of written blocks; fdatasync only needs
+	// metadata if the size or the mapping changed
+	struct cached_inode *ci = ilock(ino, 1);
+	if(ci == NULL){
+		return -EIO;
+	}
+	int *blocks = ci->sync_blocks, n = ci->nsync;
+	int meta = !datasync || ci->meta_dirty;
+	ci->sync_blocks = NULL;
+	ci->nsync = ci->sync_cap = 0;
+	ci->meta_dirty = 0;
+	struct inode inode;
+	readi(ino, &inode);
+	iunlock(ci);
+	TRACE(TRACE_DEBUG, TR_FSYNC, ino, n, meta);
+
+	// Step 3: Write out just those blocks (sync everything if some inode lost
+	// its list), before any metadata that points at them
+	if(__atomic_exchange_n(&sync_lost, 0, __ATOMIC_RELAXED)){
+		ret = bio_sync();
+	}else{
+		ret = bio_sync_blocks(blocks, n);
+	}
+	free(blocks);
 
-	fuse_stat = fuse_main(argc, argv, &tfs_ope, NULL);
+	// Step 4: Metadata goes through a journal commit, or without the journal
+	// the inode's own blocks are written out
+	if(ret == 0 && meta){
+		if(journal_on){
+			ret = jnl_commit();
+		}else{
+			int nm, *mblocks;
+			ret = sync_inodes();
+			ret |= bitmap_sync(&ino_bmap);
+			ret |= bitmap_sync(&blk_bmap);
+			mblocks = inode_meta_blocks(&inode, &nm);
+			ret |= bio_sync_blocks(mblocks, nm);
+			free(mblocks);
+		}
+	}
 
-	return fuse_stat;
+	// Step 5: One barrier makes everything written out above durable
+	if(ret == 0){
+		ret = bio_sync_barrier();
+	}
+	if(ret < 0){
+		//the blocks are off the list now, so the next fsync has to do it all
+		__atomic_store_n(&sync_lost, 1, __ATOMIC_RELAXED);
+		return -EIO;
+	}
+	return 0;
 }
 
+int tfs_utimens(const char *path, const struct timespec tv[2]) {
+	// For this project, you don't need to fill this function
+	// But DO NOT DELETE IT!
+    return 0;
+}
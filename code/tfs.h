@@ -7,60 +7,214 @@
  */
 
 #include <linux/limits.h>
+#include <stddef.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #ifndef _TFS_H
 #define _TFS_H
 
-#define MAGIC_NUM 0x5C3A
-#define MAX_INUM 1024
-#define MAX_DNUM 16384
+#define MAGIC_NUM 0x5C3B			/* 0x5C3A images had 16-bit counts and one-block bitmaps */
 
+/*
+ * On-disk format revision within MAGIC_NUM, in superblock.version:
+ *  0  directories of fixed 216-byte dirents
+ *  1  packed variable-length directory records (struct dir_rec)
+ * Mount only takes the current one.
+ */
+#define TFS_VERSION 1
+
+/*
+ * Geometry mkfs uses unless told otherwise (see tfs_geometry_config()).
+ * The data region is whatever is left after the superblock, journal,
+ * bitmaps and inode table.
+ */
+#define DEFAULT_DISK_SIZE (32*1024*1024)
+#define DEFAULT_INODES 1024
+#define JOURNAL_BLOCKS 256			/* least metadata journal mkfs makes, in blocks */
+#define BLOCKS_PER_GROUP (BLOCK_SIZE*8)	/* data blocks per allocation group: one bitmap block */
 
+/*
+ * Block 0. Every region is a run of blocks: the journal, the inode bitmap,
+ * the data block bitmap, the inode table and the data blocks, in that
+ * order. The bitmaps and the inode table take as many blocks as their
+ * counts need. The inodes and data blocks are split into allocation
+ * groups; images with groups == 0 predate them and are one group.
+ */
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
-	uint16_t	max_inum;			/* maximum inode number */
-	uint16_t	max_dnum;			/* maximum data block number */
+	uint32_t	block_size;			/* BLOCK_SIZE the image was made with */
+	uint64_t	disk_size;			/* image size in bytes */
+	uint32_t	max_inum;			/* number of inodes */
+	uint32_t	max_dnum;			/* number of data blocks */
 	uint32_t	i_bitmap_blk;		/* start block of inode bitmap */
+	uint32_t	i_bitmap_blocks;
 	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
+	uint32_t	d_bitmap_blocks;
 	uint32_t	i_start_blk;		/* start block of inode region */
+	uint32_t	i_blocks;
 	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	j_start_blk;		/* start block of the metadata journal */
+	uint32_t	j_blocks;			/* journal size in blocks, 0 for none */
+	uint32_t	groups;				/* number of allocation groups */
+	uint32_t	inodes_per_group;	/* multiples of 64, the last group may be short */
+	uint32_t	blocks_per_group;
+	uint32_t	version;			/* TFS_VERSION the image was made with */
+};
+
+/*
+ * Metadata journal. A transaction is written at the start of the journal
+ * region as a descriptor block listing the home block numbers, then the
+ * block images, then a commit block. It is complete (and replayed at mount)
+ * when both carry the same seq and the commit checksum matches the
+ * descriptor and images.
+ */
+#define JNL_DESC_MAGIC 0x4A444553
+#define JNL_COMMIT_MAGIC 0x4A434D54
+#define JNL_DESC_MAX ((BLOCK_SIZE-12)/4)
+
+struct jnl_desc {
+	uint32_t	magic;				/* JNL_DESC_MAGIC */
+	uint32_t	seq;
+	uint32_t	count;				/* block images that follow */
+	uint32_t	blocks[JNL_DESC_MAX];	/* their home block numbers */
+};
+
+struct jnl_commit {
+	uint32_t	magic;				/* JNL_COMMIT_MAGIC */
+	uint32_t	seq;
+	uint32_t	checksum;			/* FNV-1a of the descriptor and images */
 };
 
+/*
+ * Extent mapping. A run of len contiguous data blocks starting at data block
+ * start (relative to d_start_blk) holds logical blocks lblk..lblk+len-1.
+ * The inode holds an extent_header and EXT_ROOT_MAX entries: at depth 0
+ * they are the file's extents, at depth d > 0 they are index entries whose
+ * start is a block holding up to EXT_LEAF_MAX entries of depth d-1 (sorted
+ * by lblk) for logical blocks from its lblk up to the next index entry's.
+ * Depth 0 blocks are the leaves and hold extents.
+ */
+#define EXT_MAGIC 0xE47E
+#define EXT_ROOT_MAX 4
+#define EXT_DEPTH_MAX 4
+
+struct extent_header {
+	uint16_t	magic;				/* EXT_MAGIC */
+	uint16_t	entries;			/* entries in use */
+	uint16_t	depth;				/* 0: entries are extents, 1: index entries */
+	uint16_t	pad;
+};
+
+struct extent {
+	uint32_t	lblk;				/* first logical block covered */
+	uint32_t	start;				/* first data block (or leaf block for index entries) */
+	uint32_t	len;				/* number of blocks */
+};
+
+#define EXT_LEAF_MAX ((BLOCK_SIZE-sizeof(struct extent_header))/sizeof(struct extent))
+
+struct extent_leaf {
+	struct extent_header hdr;
+	struct extent	extents[EXT_LEAF_MAX];
+};
+
+/*
+ * Files of up to INODE_INLINE_MAX bytes keep their data in the inode
+ * itself (INODE_FL_INLINE), in the space the block mapping takes
+ * otherwise; they move to data blocks when they grow past it.
+ */
+#define INODE_INLINE_MAX 236
+
 struct inode {
-	uint16_t	ino;				/* inode number */
+	uint32_t	ino;				/* inode number */
 	uint16_t	valid;				/* validity of the inode */
+	uint16_t	type;				/* type of the file */
 	uint32_t	size;				/* size of the file */
-	uint32_t	type;				/* type of the file */
+	uint16_t	flags;				/* INODE_FL_* */
+	uint16_t	pad;
 	uint32_t	link;				/* link count */
-	int			direct_ptr[16];		/* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
-	struct stat	vstat;				/* inode stat */
+	union {
+		int			direct_ptr[16];		/* direct pointer to data block (inodes without INODE_FL_EXTENTS) */
+		struct {
+			struct extent_header eh;	/* extent tree root */
+			struct extent	extents[EXT_ROOT_MAX];
+		};
+		char		inline_data[INODE_INLINE_MAX];	/* INODE_FL_INLINE: the data, zeroes past size */
+	};
 };
+//the inode table packs 16 to a 4KB block; a field that grows has to take its room from the union
+_Static_assert(sizeof(struct inode) == 256, "struct inode is part of the on-disk format");
+
+#define INODE_FL_INDEX 0x1			/* directory uses a hashed index (dx_root in block 0) */
+#define INODE_FL_EXTENTS 0x2		/* data is mapped by extents instead of direct_ptr[] */
+#define INODE_FL_INLINE 0x4			/* data is in inline_data[], no blocks mapped */
 
+/*
+ * A directory block (a leaf, in an indexed directory) is a dir_leaf header
+ * followed by count records packed back to back, used bytes in all, each
+ * DIR_REC_LEN(name_len) bytes long. Removing a record moves the ones after
+ * it down, so a block's free space is always at its end.
+ */
+struct dir_leaf {
+	uint16_t	count;				/* records in the block */
+	uint16_t	used;				/* bytes of recs[] they take */
+	char		recs[];
+};
+
+struct dir_rec {
+	uint32_t	ino;				/* inode number of the entry */
+	uint8_t		name_len;
+	char		name[];				/* name_len bytes, no terminating NUL */
+};
+
+#define DIR_REC_LEN(len) ((offsetof(struct dir_rec, name)+(len)+3) & ~(size_t)3)
+#define DIR_SPACE ((int)(BLOCK_SIZE-sizeof(struct dir_leaf)))	/* record bytes a block holds */
+
+//A directory entry as dir_find() returns it
 struct dirent {
-	uint16_t ino;					/* inode number of the directory entry */
+	uint32_t ino;					/* inode number of the directory entry */
 	uint16_t valid;					/* validity of the directory entry */
-	char name[208];					/* name of the directory entry */
+	char name[208];					/* name of the directory entry, NUL terminated */
 	uint16_t len;					/* length of name */
 };
 
+/*
+ * Hashed directory index, kept in logical block 0 of an indexed directory.
+ * entries[] is sorted by hash; entry i covers the names whose hash is in
+ * [entries[i].hash, entries[i+1].hash) and points at the leaf block that
+ * holds their records. entries[0].hash is always 0.
+ */
+#define DX_MAGIC 0x44580001
+
+struct dx_entry {
+	uint32_t	hash;				/* lowest name hash stored in the leaf */
+	uint32_t	block;				/* logical block of the leaf in the directory */
+};
+
+#define DX_MAX_ENTRIES ((BLOCK_SIZE-2*sizeof(uint32_t))/sizeof(struct dx_entry))
+
+struct dx_root {
+	uint32_t	magic;				/* DX_MAGIC */
+	uint32_t	count;				/* number of entries in use */
+	struct dx_entry entries[DX_MAX_ENTRIES];
+};
+
 
 /*
  * bitmap operations
  */
 typedef unsigned char* bitmap_t;
 
-void set_bitmap(bitmap_t b, int i) {
+static inline void set_bitmap(bitmap_t b, int i) {
     b[i / 8] |= 1 << (i & 7);
 }
 
-void unset_bitmap(bitmap_t b, int i) {
+static inline void unset_bitmap(bitmap_t b, int i) {
     b[i / 8] &= ~(1 << (i & 7));
 }
 
-uint8_t get_bitmap(bitmap_t b, int i) {
+static inline uint8_t get_bitmap(bitmap_t b, int i) {
     return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
 }
 
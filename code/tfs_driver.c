@@ -0,0 +1,516 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_driver.c
+ *
+ *	Runs the benchmark/bench.c workloads against libtfs in process: no
+ *	FUSE, no mount and no kernel round trips, so the numbers are the cost
+ *	of the file system engine alone. Results use the same JSON layout as
+ *	bench, so the two can be compared workload by workload.
+ *
+ *	usage: tfs_driver [-d diskfile] [-k] [-o out.json] [-w seq,rand,meta,mt]
+ *	                  [-f file_mb] [-r rand_ops] [-n files] [-D depth] [-t threads]
+ *	                  [-m] [-u uring_depth] [-a] [-T tracefile] [-s]
+ *	                  [-S disk_mb] [-I inodes] [-G blocks_per_group]
+ *
+ *	The disk file (default DRIVERFILE) is made anew, with the -S/-I/-G
+ *	geometry, unless -k keeps it.
+ *	-m, -u and -a are the mmap, uring_depth and delalloc mount options,
+ *	-s prints the block layer stats and counters (see stats.h; the FUSE
+ *	handler rows only exist in tfs) to stderr at the end.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "libtfs.h"
+#include "stats.h"
+
+#define FSPATHLEN 256
+#define FILEPERM 0666
+#define DIRPERM 0755
+#define MAX_IO_SIZE (256*1024)
+#define MAX_RESULTS 64
+
+static const int io_sizes[] = { 4096, 16384, 65536, 262144 };
+#define N_IO_SIZES ((int)(sizeof(io_sizes)/sizeof(io_sizes[0])))
+
+static const char *disk_path = "DRIVERFILE";
+static const char *work_dir = "/bench";
+static long file_mb = 8;
+static long rand_ops = 2048;
+static long n_files = 500;
+static long tree_depth = 16;
+static long n_threads = 4;
+
+/* latency samples of one measurement, in ns */
+struct lat {
+	uint64_t	*ns;
+	size_t		n, cap;
+};
+
+struct result {
+	char		name[32];
+	int			io_size;			/* 0 for metadata workloads */
+	int			threads;
+	uint64_t	ops;
+	uint64_t	bytes;
+	uint64_t	elapsed_ns;
+	struct lat	lat;
+};
+
+static struct result results[MAX_RESULTS];
+static int n_results = 0;
+
+static void lat_add(struct lat *l, uint64_t ns) {
+	if (l->n == l->cap) {
+		l->cap = l->cap ? l->cap*2 : 1024;
+		l->ns = realloc(l->ns, sizeof(uint64_t)*l->cap);
+		if (l->ns == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	l->ns[l->n++] = ns;
+}
+
+static void die(const char *what, const char *path, int err) {
+	fprintf(stderr, "%s %s: %s\n", what, path, strerror(-err));
+	exit(1);
+}
+
+static struct result *result_new(const char *name, int io_size, int threads) {
+	if (n_results == MAX_RESULTS) {
+		fprintf(stderr, "too many results\n");
+		exit(1);
+	}
+	struct result *r = &results[n_results++];
+	memset(r, 0, sizeof(*r));
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->io_size = io_size;
+	r->threads = threads;
+	return r;
+}
+
+//xorshift64, one state per thread
+static uint64_t next_rand(uint64_t *s) {
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static void fill(char *buf, size_t len, int seed) {
+	size_t i;
+	for (i = 0; i < len; i++) {
+		buf[i] = 'a' + (i+seed) % 26;
+	}
+}
+
+//Call an operation that returns a byte count, failing unless it is want
+static void io_call(int ret, int want, const char *what, const char *path) {
+	if (ret != want) {
+		die(what, path, ret < 0 ? ret : -EIO);
+	}
+}
+
+/*
+ * seq: write a file_mb file front to back with each I/O size (fsync
+ * included in the elapsed time), then read it back the same way.
+ */
+static void bench_seq() {
+	char path[FSPATHLEN];
+	char *buf = malloc(MAX_IO_SIZE);
+	struct open_file *of;
+	int i, ret;
+	fill(buf, MAX_IO_SIZE, 0);
+	for (i = 0; i < N_IO_SIZES; i++) {
+		int sz = io_sizes[i];
+		long n = file_mb*1024*1024/sz, k;
+		snprintf(path, sizeof(path), "%s/seq%d", work_dir, sz);
+
+		struct result *w = result_new("seq_write", sz, 1);
+		uint64_t start = stat_now();
+		if ((ret = tfs_create(path, FILEPERM, &of)) < 0) {
+			die("create", path, ret);
+		}
+		for (k = 0; k < n; k++) {
+			uint64_t t = stat_now();
+			io_call(tfs_write(path, buf, sz, (off_t)k*sz, of), sz, "write", path);
+			lat_add(&w->lat, stat_now()-t);
+		}
+		if ((ret = tfs_fsync(path, 0, of)) < 0 || (ret = tfs_release(path, of)) < 0) {
+			die("fsync", path, ret);
+		}
+		w->elapsed_ns = stat_now()-start;
+		w->ops = n;
+		w->bytes = (uint64_t)n*sz;
+
+		struct result *r = result_new("seq_read", sz, 1);
+		start = stat_now();
+		if ((ret = tfs_open(path, &of)) < 0) {
+			die("open", path, ret);
+		}
+		for (k = 0; k < n; k++) {
+			uint64_t t = stat_now();
+			io_call(tfs_read(path, buf, sz, (off_t)k*sz, of), sz, "read", path);
+			lat_add(&r->lat, stat_now()-t);
+		}
+		tfs_release(path, of);
+		r->elapsed_ns = stat_now()-start;
+		r->ops = n;
+		r->bytes = (uint64_t)n*sz;
+		tfs_unlink(path);
+		fprintf(stderr, "seq %d done\n", sz);
+	}
+	free(buf);
+}
+
+/*
+ * rand: rand_ops aligned writes then reads at random offsets of a
+ * preallocated file_mb file, for each I/O size.
+ */
+static void bench_rand() {
+	char path[FSPATHLEN];
+	char *buf = malloc(MAX_IO_SIZE);
+	uint64_t seed = 0x9E3779B97F4A7C15ULL;
+	long size = file_mb*1024*1024, k;
+	struct open_file *of;
+	int i, ret;
+	fill(buf, MAX_IO_SIZE, 1);
+	snprintf(path, sizeof(path), "%s/rand", work_dir);
+	if ((ret = tfs_create(path, FILEPERM, &of)) < 0) {
+		die("create", path, ret);
+	}
+	for (k = 0; k < size; k += MAX_IO_SIZE) {
+		io_call(tfs_write(path, buf, MAX_IO_SIZE, k, of), MAX_IO_SIZE, "write", path);
+	}
+	tfs_fsync(path, 0, of);
+	for (i = 0; i < N_IO_SIZES; i++) {
+		int sz = io_sizes[i];
+		long slots = size/sz;
+		struct result *w = result_new("rand_write", sz, 1);
+		uint64_t start = stat_now();
+		for (k = 0; k < rand_ops; k++) {
+			off_t off = (off_t)(next_rand(&seed) % slots)*sz;
+			uint64_t t = stat_now();
+			io_call(tfs_write(path, buf, sz, off, of), sz, "write", path);
+			lat_add(&w->lat, stat_now()-t);
+		}
+		tfs_fsync(path, 0, of);
+		w->elapsed_ns = stat_now()-start;
+		w->ops = rand_ops;
+		w->bytes = (uint64_t)rand_ops*sz;
+
+		struct result *r = result_new("rand_read", sz, 1);
+		start = stat_now();
+		for (k = 0; k < rand_ops; k++) {
+			off_t off = (off_t)(next_rand(&seed) % slots)*sz;
+			uint64_t t = stat_now();
+			io_call(tfs_read(path, buf, sz, off, of), sz, "read", path);
+			lat_add(&r->lat, stat_now()-t);
+		}
+		r->elapsed_ns = stat_now()-start;
+		r->ops = rand_ops;
+		r->bytes = (uint64_t)rand_ops*sz;
+		fprintf(stderr, "rand %d done\n", sz);
+	}
+	tfs_release(path, of);
+	tfs_unlink(path);
+	free(buf);
+}
+
+//Time one metadata operation into r
+#define TIMED_CALL(r, call, what, path) do { \
+	uint64_t t_ = stat_now(); \
+	int ret_ = (call); \
+	if (ret_ < 0) { \
+		die(what, path, ret_); \
+	} \
+	lat_add(&(r)->lat, stat_now()-t_); \
+	(r)->ops++; \
+} while (0)
+
+/*
+ * meta: create, stat and unlink n_files files, first all in one directory
+ * (wide) and then spread over a chain of tree_depth nested directories
+ * (deep, where every lookup walks the whole path).
+ */
+static void bench_meta() {
+	char path[2*FSPATHLEN], dir[FSPATHLEN];
+	struct stat st;
+	long i, d;
+
+	// wide: one directory
+	struct result *c = result_new("wide_create", 0, 1);
+	struct result *s = result_new("wide_stat", 0, 1);
+	struct result *u = result_new("wide_unlink", 0, 1);
+	snprintf(dir, sizeof(dir), "%s/wide", work_dir);
+	if ((i = tfs_mkdir(dir, DIRPERM)) < 0) {
+		die("mkdir", dir, i);
+	}
+	uint64_t start = stat_now();
+	for (i = 0; i < n_files; i++) {
+		snprintf(path, sizeof(path), "%s/f%ld", dir, i);
+		TIMED_CALL(c, tfs_create(path, FILEPERM, NULL), "create", path);
+	}
+	c->elapsed_ns = stat_now()-start;
+	start = stat_now();
+	for (i = 0; i < n_files; i++) {
+		snprintf(path, sizeof(path), "%s/f%ld", dir, (i*7919) % n_files);
+		TIMED_CALL(s, tfs_getattr(path, &st), "getattr", path);
+	}
+	s->elapsed_ns = stat_now()-start;
+	start = stat_now();
+	for (i = 0; i < n_files; i++) {
+		snprintf(path, sizeof(path), "%s/f%ld", dir, i);
+		TIMED_CALL(u, tfs_unlink(path), "unlink", path);
+	}
+	u->elapsed_ns = stat_now()-start;
+	tfs_rmdir(dir);
+	fprintf(stderr, "wide done\n");
+
+	// deep: files spread over every level of a directory chain
+	c = result_new("deep_create", 0, 1);
+	s = result_new("deep_stat", 0, 1);
+	u = result_new("deep_unlink", 0, 1);
+	char **dirs = malloc(sizeof(char*)*tree_depth);
+	snprintf(dir, sizeof(dir), "%s", work_dir);
+	for (d = 0; d < tree_depth; d++) {
+		if (strlen(dir)+4 >= FSPATHLEN) {
+			tree_depth = d;
+			break;
+		}
+		strcat(dir, "/d");
+		dirs[d] = strdup(dir);
+	}
+	start = stat_now();
+	for (d = 0; d < tree_depth; d++) {
+		TIMED_CALL(c, tfs_mkdir(dirs[d], DIRPERM), "mkdir", dirs[d]);
+	}
+	for (i = 0; i < n_files; i++) {
+		snprintf(path, sizeof(path), "%s/f%ld", dirs[i % tree_depth], i);
+		TIMED_CALL(c, tfs_create(path, FILEPERM, NULL), "create", path);
+	}
+	c->elapsed_ns = stat_now()-start;
+	start = stat_now();
+	for (i = 0; i < n_files; i++) {
+		long j = (i*7919) % n_files;
+		snprintf(path, sizeof(path), "%s/f%ld", dirs[j % tree_depth], j);
+		TIMED_CALL(s, tfs_getattr(path, &st), "getattr", path);
+	}
+	s->elapsed_ns = stat_now()-start;
+	start = stat_now();
+	for (i = 0; i < n_files; i++) {
+		snprintf(path, sizeof(path), "%s/f%ld", dirs[i % tree_depth], i);
+		TIMED_CALL(u, tfs_unlink(path), "unlink", path);
+	}
+	for (d = tree_depth-1; d >= 0; d--) {
+		TIMED_CALL(u, tfs_rmdir(dirs[d]), "rmdir", dirs[d]);
+		free(dirs[d]);
+	}
+	u->elapsed_ns = stat_now()-start;
+	free(dirs);
+	fprintf(stderr, "deep done\n");
+}
+
+/*
+ * mt: n_threads threads, each on its own 1MB file, doing rand_ops
+ * operations: 60% 4K reads, 30% 4K writes, 10% getattrs.
+ */
+struct mt_arg {
+	int			id;
+	struct lat	lat;
+	uint64_t	bytes;
+};
+
+static void *mt_worker(void *p) {
+	struct mt_arg *a = p;
+	char path[FSPATHLEN], buf[4096];
+	struct stat st;
+	uint64_t seed = 0x2545F4914F6CDD1DULL * (a->id+1);
+	long k, slots = 256;
+	struct open_file *of;
+	int ret;
+	fill(buf, sizeof(buf), a->id);
+	snprintf(path, sizeof(path), "%s/mt%d", work_dir, a->id);
+	if ((ret = tfs_create(path, FILEPERM, &of)) < 0) {
+		die("create", path, ret);
+	}
+	for (k = 0; k < slots; k++) {
+		io_call(tfs_write(path, buf, sizeof(buf), k*sizeof(buf), of), sizeof(buf), "write", path);
+	}
+	for (k = 0; k < rand_ops; k++) {
+		uint64_t r = next_rand(&seed);
+		off_t off = (off_t)((r >> 8) % slots)*sizeof(buf);
+		uint64_t t = stat_now();
+		if (r % 10 < 6) {
+			io_call(tfs_read(path, buf, sizeof(buf), off, of), sizeof(buf), "read", path);
+			a->bytes += sizeof(buf);
+		} else if (r % 10 < 9) {
+			io_call(tfs_write(path, buf, sizeof(buf), off, of), sizeof(buf), "write", path);
+			a->bytes += sizeof(buf);
+		} else if ((ret = tfs_getattr(path, &st)) < 0) {
+			die("getattr", path, ret);
+		}
+		lat_add(&a->lat, stat_now()-t);
+	}
+	tfs_release(path, of);
+	tfs_unlink(path);
+	return NULL;
+}
+
+static void bench_mt() {
+	pthread_t *tids = malloc(sizeof(pthread_t)*n_threads);
+	struct mt_arg *args = calloc(n_threads, sizeof(struct mt_arg));
+	struct result *r = result_new("mt_mixed", 4096, n_threads);
+	long i;
+	size_t k;
+	uint64_t start = stat_now();
+	for (i = 0; i < n_threads; i++) {
+		args[i].id = i;
+		pthread_create(&tids[i], NULL, mt_worker, &args[i]);
+	}
+	for (i = 0; i < n_threads; i++) {
+		pthread_join(tids[i], NULL);
+		for (k = 0; k < args[i].lat.n; k++) {
+			lat_add(&r->lat, args[i].lat.ns[k]);
+		}
+		r->bytes += args[i].bytes;
+		free(args[i].lat.ns);
+	}
+	r->elapsed_ns = stat_now()-start;
+	r->ops = r->lat.n;
+	free(args);
+	free(tids);
+	fprintf(stderr, "mt done\n");
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double pct_us(struct lat *l, double p) {
+	if (l->n == 0) {
+		return 0;
+	}
+	size_t i = (size_t)(p*(l->n-1));
+	return l->ns[i]/1000.0;
+}
+
+static void print_json(FILE *f) {
+	int i;
+	fprintf(f, "{\n  \"disk\": \"%s\",\n  \"in_process\": true,\n  \"time\": %ld,\n  \"results\": [\n",
+		disk_path, (long)time(NULL));
+	for (i = 0; i < n_results; i++) {
+		struct result *r = &results[i];
+		double secs = r->elapsed_ns/1e9;
+		uint64_t sum = 0;
+		size_t k;
+		qsort(r->lat.ns, r->lat.n, sizeof(uint64_t), cmp_u64);
+		for (k = 0; k < r->lat.n; k++) {
+			sum += r->lat.ns[k];
+		}
+		fprintf(f, "    {\"name\": \"%s\", \"io_size\": %d, \"threads\": %d, \"ops\": %llu, \"bytes\": %llu, "
+			"\"seconds\": %.6f, \"ops_per_s\": %.1f, \"mb_per_s\": %.2f, "
+			"\"lat_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}%s\n",
+			r->name, r->io_size, r->threads, (unsigned long long)r->ops, (unsigned long long)r->bytes,
+			secs, secs > 0 ? r->ops/secs : 0, secs > 0 ? r->bytes/secs/(1024*1024) : 0,
+			r->lat.n ? sum/1000.0/r->lat.n : 0, pct_us(&r->lat, 0.5), pct_us(&r->lat, 0.9),
+			pct_us(&r->lat, 0.99), pct_us(&r->lat, 0.999), pct_us(&r->lat, 1.0),
+			i+1 < n_results ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-d diskfile] [-k] [-o out.json] [-w seq,rand,meta,mt]\n"
+		"          [-f file_mb] [-r rand_ops] [-n files] [-D depth] [-t threads]\n"
+		"          [-m] [-u uring_depth] [-a] [-T tracefile] [-s]\n"
+		"          [-S disk_mb] [-I inodes] [-G blocks_per_group]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	const char *out = NULL, *workloads = "seq,rand,meta,mt", *trace = NULL;
+	int opt, keep = 0, show_stats = 0, ret;
+	struct tfs_geometry geo = {0};
+	while ((opt = getopt(argc, argv, "d:ko:w:f:r:n:D:t:mu:aT:sS:I:G:")) != -1) {
+		switch (opt) {
+		case 'd': disk_path = optarg; break;
+		case 'k': keep = 1; break;
+		case 'o': out = optarg; break;
+		case 'w': workloads = optarg; break;
+		case 'f': file_mb = atol(optarg); break;
+		case 'r': rand_ops = atol(optarg); break;
+		case 'n': n_files = atol(optarg); break;
+		case 'D': tree_depth = atol(optarg); break;
+		case 't': n_threads = atol(optarg); break;
+		case 'm': bio_mmap_config(1); break;
+		case 'u': bio_uring_config(atoi(optarg), 0); break;
+		case 'a': tfs_delalloc_config(1); break;
+		case 'T': trace = optarg; break;
+		case 's': show_stats = 1; break;
+		case 'S': geo.disk_size = (uint64_t)atol(optarg)*1024*1024; break;
+		case 'I': geo.inodes = atol(optarg); break;
+		case 'G': geo.blocks_per_group = atol(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (file_mb < 1 || rand_ops < 1 || n_files < 1 || tree_depth < 1 || n_threads < 1) {
+		usage(argv[0]);
+	}
+
+	if (!keep) {
+		unlink(disk_path);
+	}
+	tfs_geometry_config(&geo);
+	if ((ret = tfs_mount(disk_path, trace)) < 0) {
+		die("mount", disk_path, ret);
+	}
+	if ((ret = tfs_mkdir(work_dir, DIRPERM)) < 0) {
+		die("mkdir", work_dir, ret);
+	}
+	if (strstr(workloads, "seq")) {
+		bench_seq();
+	}
+	if (strstr(workloads, "rand")) {
+		bench_rand();
+	}
+	if (strstr(workloads, "meta")) {
+		bench_meta();
+	}
+	if (strstr(workloads, "mt")) {
+		bench_mt();
+	}
+	tfs_rmdir(work_dir);
+	if ((ret = tfs_unmount()) < 0) {
+		die("unmount", disk_path, ret);
+	}
+
+	if (show_stats) {
+		size_t len;
+		char *text = stats_render(&len);
+		if (text != NULL) {
+			fwrite(text, 1, len, stderr);
+			free(text);
+		}
+	}
+	FILE *f = stdout;
+	if (out != NULL && (f = fopen(out, "w")) == NULL) {
+		perror(out);
+		return 1;
+	}
+	print_json(f);
+	if (f != stdout) {
+		fclose(f);
+	}
+	return 0;
+}
@@ -0,0 +1,333 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_fuse.c
+ *
+ *	The tfs program: libtfs (see libtfs.h) behind FUSE, plus the mount
+ *	options and the STATS_FILE that only exist in a mounted file system.
+ *
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <stddef.h>
+#include "libtfs.h"
+#include "stats.h"
+
+char diskfile_path[PATH_MAX];
+char tracefile_path[PATH_MAX];
+
+/*
+ * STATS_FILE is a read-only file at the root that isn't on disk; reading
+ * it renders the current statistics. It is opened direct_io, so reads
+ * aren't cut off at whatever size getattr reported earlier.
+ */
+static int is_stats_file(const char *path) {
+	return strcmp(path, STATS_FILE) == 0;
+}
+
+static int stats_getattr(struct stat *stbuf) {
+	size_t len = 0;
+	free(stats_render(&len));
+	stbuf->st_mode = S_IFREG | 0444;
+	time(&stbuf->st_mtime);
+	stbuf->st_nlink = 1;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_size = len;
+	return 0;
+}
+
+static int stats_read(char *buffer, size_t size, off_t offset) {
+	size_t len;
+	char *text = stats_render(&len);
+	if(text == NULL){
+		return -ENOMEM;
+	}
+	if(offset >= (off_t)len){
+		size = 0;
+	}else if(offset+size > len){
+		size = len-offset;
+	}
+	memcpy(buffer, text+offset, size);
+	free(text);
+	return size;
+}
+
+//The open file handle tfs_open()/tfs_create() stored in fi->fh
+static struct open_file *file_of(struct fuse_file_info *fi) {
+	return fi != NULL ? (struct open_file*)(uintptr_t)fi->fh : NULL;
+}
+
+//The directory cursor tfs_opendir() stored in fi->fh
+static struct dir_cursor *dir_of(struct fuse_file_info *fi) {
+	return fi != NULL ? (struct dir_cursor*)(uintptr_t)fi->fh : NULL;
+}
+
+static void *op_init(struct fuse_conn_info *conn) {
+	//init can't fail, so an unusable image ends the session right away
+	if(tfs_mount(diskfile_path, tracefile_path) < 0){
+		fuse_exit(fuse_get_context()->fuse);
+	}
+	return NULL;
+}
+
+static void op_destroy(void *userdata) {
+	tfs_unmount();
+}
+
+static int op_getattr(const char *path, struct stat *stbuf) {
+	if(is_stats_file(path)){
+		return stats_getattr(stbuf);
+	}
+	return tfs_getattr(path, stbuf);
+}
+
+static int op_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+	return tfs_readdir(path, buffer, filler, offset, dir_of(fi));
+}
+
+static int op_opendir(const char *path, struct fuse_file_info *fi) {
+	struct dir_cursor *dc = NULL;
+	int ret = tfs_opendir(path, fi != NULL ? &dc : NULL);
+	if(fi != NULL){
+		fi->fh = (uintptr_t)dc;
+	}
+	return ret;
+}
+
+static int op_releasedir(const char *path, struct fuse_file_info *fi) {
+	int ret = tfs_releasedir(path, dir_of(fi));
+	if(fi != NULL){
+		fi->fh = 0;
+	}
+	return ret;
+}
+
+static int op_mkdir(const char *path, mode_t mode) {
+	if(is_stats_file(path)){
+		return -EEXIST;
+	}
+	return tfs_mkdir(path, mode);
+}
+
+static int op_rmdir(const char *path) {
+	return tfs_rmdir(path);
+}
+
+static int op_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	if(is_stats_file(path)){
+		return -EEXIST;
+	}
+	struct open_file *of = NULL;
+	int ret = tfs_create(path, mode, fi != NULL ? &of : NULL);
+	if(fi != NULL){
+		fi->fh = (uintptr_t)of;
+	}
+	return ret;
+}
+
+static int op_open(const char *path, struct fuse_file_info *fi) {
+	if(is_stats_file(path)){
+		if((fi->flags & O_ACCMODE) != O_RDONLY){
+			return -EACCES;
+		}
+		fi->direct_io = 1;
+		fi->fh = 0;
+		return 0;
+	}
+	struct open_file *of = NULL;
+	int ret = tfs_open(path, &of);
+	fi->fh = (uintptr_t)of;
+	return ret;
+}
+
+static int op_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	if(is_stats_file(path)){
+		return stats_read(buffer, size, offset);
+	}
+	return tfs_read(path, buffer, size, offset, file_of(fi));
+}
+
+static int op_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	return tfs_write(path, buffer, size, offset, file_of(fi));
+}
+
+static int op_unlink(const char *path) {
+	if(is_stats_file(path)){
+		return -EACCES;
+	}
+	return tfs_unlink(path);
+}
+
+static int op_truncate(const char *path, off_t size) {
+	return tfs_truncate(path, size);
+}
+
+static int op_flush(const char *path, struct fuse_file_info *fi) {
+	if(is_stats_file(path)){
+		return 0;
+	}
+	return tfs_flush(path, file_of(fi));
+}
+
+static int op_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	if(is_stats_file(path)){
+		return 0;
+	}
+	return tfs_fsync(path, datasync, file_of(fi));
+}
+
+static int op_utimens(const char *path, const struct timespec tv[2]) {
+	return tfs_utimens(path, tv);
+}
+
+static int op_release(const char *path, struct fuse_file_info *fi) {
+	if(is_stats_file(path)){
+		return 0;
+	}
+	int ret = tfs_release(path, file_of(fi));
+	fi->fh = 0;
+	return ret;
+}
+
+/*
+ * Every handler but init/destroy is called through an op_name_timed() wrapper
+ * that adds it to the per-operation stats (see stats.h).
+ */
+#define TIMED(op, name, params, args) \
+static int name##_timed params { \
+	uint64_t start = stat_now(); \
+	int ret = name args; \
+	stat_op(op, start, ret); \
+	return ret; \
+}
+
+TIMED(ST_GETATTR, op_getattr, (const char *path, struct stat *stbuf), (path, stbuf))
+TIMED(ST_READDIR, op_readdir, (const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi), (path, buffer, filler, offset, fi))
+TIMED(ST_OPENDIR, op_opendir, (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED(ST_RELEASEDIR, op_releasedir, (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED(ST_MKDIR, op_mkdir, (const char *path, mode_t mode), (path, mode))
+TIMED(ST_RMDIR, op_rmdir, (const char *path), (path))
+TIMED(ST_CREATE, op_create, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi))
+TIMED(ST_OPEN, op_open, (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED(ST_READ, op_read, (const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi), (path, buffer, size, offset, fi))
+TIMED(ST_WRITE, op_write, (const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi), (path, buffer, size, offset, fi))
+TIMED(ST_UNLINK, op_unlink, (const char *path), (path))
+TIMED(ST_TRUNCATE, op_truncate, (const char *path, off_t size), (path, size))
+TIMED(ST_FLUSH, op_flush, (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED(ST_FSYNC, op_fsync, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi))
+TIMED(ST_UTIMENS, op_utimens, (const char *path, const struct timespec tv[2]), (path, tv))
+TIMED(ST_RELEASE, op_release, (const char *path, struct fuse_file_info *fi), (path, fi))
+
+static struct fuse_operations tfs_ope = {
+	.init		= op_init,
+	.destroy	= op_destroy,
+
+	.getattr	= op_getattr_timed,
+	.readdir	= op_readdir_timed,
+	.opendir	= op_opendir_timed,
+	.releasedir	= op_releasedir_timed,
+	.mkdir		= op_mkdir_timed,
+	.rmdir		= op_rmdir_timed,
+
+	.create		= op_create_timed,
+	.open		= op_open_timed,
+	.read 		= op_read_timed,
+	.write		= op_write_timed,
+	.unlink		= op_unlink_timed,
+
+	.truncate   = op_truncate_timed,
+	.flush      = op_flush_timed,
+	.fsync      = op_fsync_timed,
+	.utimens    = op_utimens_timed,
+	.release	= op_release_timed
+};
+
+
+/*
+ * tfs specific mount options, given as -o name[,name...]:
+ *   mmap		map the disk file instead of using pread/pwrite
+ *   uring		do multi-block I/O through io_uring
+ *   uring_depth=N	io_uring queue depth (implies uring)
+ *   uring_poll		spin on io_uring completions instead of sleeping
+ *   delalloc		buffer file data and allocate blocks at flush/release
+ *   trace=FILE		where a TRACE_LEVEL>0 build records events (default TRACEFILE)
+ * and, when DISKFILE doesn't exist yet, the geometry of the new file system:
+ *   disk_mb=N		image size in MB (default 32)
+ *   inodes=N		number of inodes (default 1024)
+ *   journal_blocks=N	metadata journal size (default: sized to the bitmaps, 256 at least)
+ *   group_blocks=N	data blocks per allocation group (default 32768)
+ */
+struct tfs_options {
+	int mmap;
+	int uring;
+	int uring_depth;
+	int uring_poll;
+	int delalloc;
+	char *trace;
+	unsigned disk_mb;
+	unsigned inodes;
+	unsigned journal_blocks;
+	unsigned group_blocks;
+};
+
+static struct fuse_opt tfs_opts[] = {
+	{"mmap", offsetof(struct tfs_options, mmap), 1},
+	{"uring", offsetof(struct tfs_options, uring), 1},
+	{"uring_depth=%d", offsetof(struct tfs_options, uring_depth), 0},
+	{"uring_poll", offsetof(struct tfs_options, uring_poll), 1},
+	{"delalloc", offsetof(struct tfs_options, delalloc), 1},
+	{"trace=%s", offsetof(struct tfs_options, trace), 0},
+	{"disk_mb=%u", offsetof(struct tfs_options, disk_mb), 0},
+	{"inodes=%u", offsetof(struct tfs_options, inodes), 0},
+	{"journal_blocks=%u", offsetof(struct tfs_options, journal_blocks), 0},
+	{"group_blocks=%u", offsetof(struct tfs_options, group_blocks), 0},
+	FUSE_OPT_END
+};
+
+int main(int argc, char *argv[]) {
+	int fuse_stat;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct tfs_options opts = {0};
+
+	getcwd(diskfile_path, PATH_MAX);
+	strcat(diskfile_path, "/DISKFILE");
+	getcwd(tracefile_path, PATH_MAX);
+	strcat(tracefile_path, "/TRACEFILE");
+
+	if (fuse_opt_parse(&args, &opts, tfs_opts, NULL) == -1) {
+		return 1;
+	}
+	if (opts.trace != NULL) {
+		//fuse_main moves to / when it daemonizes, so anchor relative paths here
+		if (opts.trace[0] == '/') {
+			snprintf(tracefile_path, PATH_MAX, "%s", opts.trace);
+		} else {
+			getcwd(tracefile_path, PATH_MAX);
+			snprintf(tracefile_path+strlen(tracefile_path), PATH_MAX-strlen(tracefile_path), "/%s", opts.trace);
+		}
+		free(opts.trace);
+	}
+	bio_mmap_config(opts.mmap);
+	tfs_delalloc_config(opts.delalloc);
+	struct tfs_geometry geo = { (uint64_t)opts.disk_mb*1024*1024, opts.inodes, opts.journal_blocks, opts.group_blocks };
+	tfs_geometry_config(&geo);
+	if (opts.uring || opts.uring_depth > 0) {
+		bio_uring_config(opts.uring_depth > 0 ? opts.uring_depth : BIO_URING_DEPTH, opts.uring_poll);
+	}
+
+	fuse_stat = fuse_main(args.argc, args.argv, &tfs_ope, NULL);
+
+	fuse_opt_free_args(&args);
+	return fuse_stat;
+}
+
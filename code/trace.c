@@ -0,0 +1,146 @@
+/*
+ *	Tiny File System
+ *	File:	trace.c
+ *
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+static struct trace_file_hdr *trace_hdr = NULL;
+static size_t trace_len = 0;
+static int trace_on = 0;
+static uint64_t trace_t0 = 0;
+
+//The calling thread's ring, taken on its first event
+static __thread struct trace_ring *my_ring = NULL;
+static __thread int my_ring_none = 0;
+static __thread uint32_t my_tid = 0;
+
+//Rings of threads that have exited, for new threads to take over
+static pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *free_rings[TRACE_RINGS];
+static int nfree = 0;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static uint64_t clock_ns(clockid_t clk) {
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static struct trace_ring *trace_ring_at(int i) {
+	return (struct trace_ring*)((char*)(trace_hdr+1) + (size_t)i*sizeof(struct trace_ring));
+}
+
+//Thread exit: give the thread's ring back
+static void ring_release(void *r) {
+	pthread_mutex_lock(&free_lock);
+	free_rings[nfree++] = r;
+	pthread_mutex_unlock(&free_lock);
+}
+
+static void ring_key_init() {
+	pthread_key_create(&ring_key, ring_release);
+}
+
+//A ring for the calling thread: one given back if there is any, else a never used one
+static struct trace_ring *ring_take() {
+	struct trace_ring *r = NULL;
+	pthread_once(&ring_key_once, ring_key_init);
+	pthread_mutex_lock(&free_lock);
+	if (nfree > 0) {
+		r = free_rings[--nfree];
+	}
+	pthread_mutex_unlock(&free_lock);
+	if (r == NULL) {
+		uint32_t i = __atomic_fetch_add(&trace_hdr->nused, 1, __ATOMIC_RELAXED);
+		if (i >= trace_hdr->nrings) {
+			__atomic_fetch_add(&trace_hdr->dropped, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+		r = trace_ring_at(i);
+	}
+	my_tid = syscall(SYS_gettid);
+	r->tid = my_tid;
+	pthread_setspecific(ring_key, r);
+	return r;
+}
+
+int trace_open(const char *path) {
+	if (TFS_TRACE_LEVEL == 0 || trace_hdr != NULL) {
+		return 0;
+	}
+	int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		perror("trace open failed");
+		return -1;
+	}
+	size_t len = sizeof(struct trace_file_hdr) + (size_t)TRACE_RINGS*sizeof(struct trace_ring);
+	void *p = MAP_FAILED;
+	if (ftruncate(fd, len) == 0) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (p == MAP_FAILED) {
+		perror("trace mmap failed");
+		return -1;
+	}
+	trace_hdr = p;
+	trace_len = len;
+	trace_hdr->magic = TRACE_MAGIC;
+	trace_hdr->nrings = TRACE_RINGS;
+	trace_hdr->ring_size = TRACE_RING_SIZE;
+	trace_hdr->level = TFS_TRACE_LEVEL;
+	trace_hdr->start = clock_ns(CLOCK_REALTIME);
+	trace_t0 = clock_ns(CLOCK_MONOTONIC);
+	__atomic_store_n(&trace_on, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Stop recording and push the trace to disk. The mapping stays, since
+ * threads may still hold their ring pointers.
+ */
+void trace_close() {
+	if (trace_hdr != NULL && __atomic_exchange_n(&trace_on, 0, __ATOMIC_ACQ_REL)) {
+		msync(trace_hdr, trace_len, MS_SYNC);
+	}
+}
+
+void trace_event(int level, int ev, uint64_t a, uint64_t b, uint64_t c) {
+	if (!__atomic_load_n(&trace_on, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	struct trace_ring *r = my_ring;
+	if (r == NULL) {
+		if (my_ring_none) {
+			return;
+		}
+		if ((r = my_ring = ring_take()) == NULL) {
+			my_ring_none = 1;
+			return;
+		}
+	}
+	//only this thread writes r; head is published after the record is complete
+	uint64_t head = r->head;
+	struct trace_rec *rec = &r->recs[head % TRACE_RING_SIZE];
+	rec->ts = clock_ns(CLOCK_MONOTONIC) - trace_t0;
+	rec->event = ev;
+	rec->level = level;
+	rec->tid = my_tid;
+	rec->args[0] = a;
+	rec->args[1] = b;
+	rec->args[2] = c;
+	__atomic_store_n(&r->head, head+1, __ATOMIC_RELEASE);
+}
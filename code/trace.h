@@ -0,0 +1,111 @@
+/*
+ *	Tiny File System
+ *	File:	trace.h
+ *
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Event tracing. TRACE() records a binary event (id plus three integer
+ * arguments) in the calling thread's ring buffer. Rings live in a shared
+ * mapping of the trace file, so whatever was recorded is still there after
+ * a crash; trace_decode prints it.
+ *
+ * Which events exist at all is decided at compile time: TFS_TRACE_LEVEL
+ * (make TRACE_LEVEL=N) keeps events of that level and below, and the
+ * default of 0 compiles every TRACE() away.
+ */
+#ifndef TFS_TRACE_LEVEL
+#define TFS_TRACE_LEVEL 0
+#endif
+
+#define TRACE_ERROR 1			/* I/O errors */
+#define TRACE_INFO 2			/* mount, unmount, journal commits */
+#define TRACE_DEBUG 3			/* per-operation events */
+
+/*
+ * Every event: id, name, and how the decoder prints its three arguments
+ * (each is passed as an unsigned long long, unused ones are ignored).
+ */
+#define TRACE_EVENTS(X) \
+	X(TR_MKFS,			"mkfs",			"i_start_blk=%llu d_start_blk=%llu journal_blocks=%llu") \
+	X(TR_MOUNT,			"mount",		"i_start_blk=%llu d_start_blk=%llu journal_blocks=%llu") \
+	X(TR_UNMOUNT,		"unmount",		"blocks_used=%llu ret=%lld") \
+	X(TR_JNL_COMMIT,	"jnl_commit",	"next_seq=%llu blocks=%llu ret=%lld") \
+	X(TR_JNL_REPLAY,	"jnl_replay",	"seq=%llu blocks=%llu") \
+	X(TR_IO_ERROR,		"io_error",		"block=%llu write=%llu errno=%llu") \
+	X(TR_LOOKUP,		"lookup",		"parent=%llu hash=%#llx ino=%lld") \
+	X(TR_NEW_NODE,		"new_node",		"parent=%llu ino=%lld type=%llu") \
+	X(TR_REMOVE_NODE,	"remove_node",	"parent=%llu ino=%lld type=%llu") \
+	X(TR_READ,			"read",			"ino=%llu offset=%llu size=%llu") \
+	X(TR_WRITE,			"write",		"ino=%llu offset=%llu size=%llu") \
+	X(TR_FSYNC,			"fsync",		"ino=%llu blocks=%llu meta=%llu") \
+	X(TR_WRITEBACK,		"writeback",	"ino=%llu pages=%llu ret=%lld") \
+	X(TR_ALLOC_INO,		"alloc_ino",	"ino=%lld") \
+	X(TR_ALLOC_RUN,		"alloc_run",	"goal=%lld start=%lld got=%llu") \
+	X(TR_FREE_RUN,		"free_run",		"start=%llu count=%llu") \
+	X(TR_BIO_MISS,		"bio_miss",		"block=%llu") \
+	X(TR_BIO_EVICT,		"bio_evict",	"block=%llu dirty=%llu") \
+	X(TR_BIO_FLUSH,		"bio_flush",	"blocks=%llu runs=%llu")
+
+#define TRACE_ENUM(id, name, fmt) id,
+enum trace_event_id { TRACE_EVENTS(TRACE_ENUM) TR_NEVENTS };
+#undef TRACE_ENUM
+
+#define TRACE(level, ev, a, b, c) do { \
+	if ((level) <= TFS_TRACE_LEVEL) { \
+		trace_event((level), (ev), (uint64_t)(a), (uint64_t)(b), (uint64_t)(c)); \
+	} \
+} while (0)
+
+/*
+ * Trace file layout: a trace_file_hdr, then nrings rings. A thread takes
+ * a ring the first time it records something and is its only writer
+ * until it exits, when the ring goes back for the next new thread to
+ * carry on in (nused counts the rings ever taken, dropped the threads
+ * that found none free). head is the total number of events written to
+ * the ring, the last min(head, ring_size) of which are still in
+ * recs[head % ring_size]; each carries the tid of the thread that wrote it.
+ */
+#define TRACE_MAGIC 0x54524331
+#define TRACE_RINGS 64
+#define TRACE_RING_SIZE 4096
+
+struct trace_rec {
+	uint64_t	ts;					/* ns since the trace was opened */
+	uint16_t	event;				/* enum trace_event_id */
+	uint16_t	level;
+	uint32_t	tid;
+	uint64_t	args[3];
+};
+
+struct trace_ring {
+	uint32_t	tid;				/* current (or last) owner */
+	uint32_t	pad;
+	uint64_t	head;
+	struct trace_rec recs[TRACE_RING_SIZE];
+};
+
+struct trace_file_hdr {
+	uint32_t	magic;				/* TRACE_MAGIC */
+	uint32_t	nrings;
+	uint32_t	ring_size;
+	uint32_t	level;				/* TFS_TRACE_LEVEL it was recorded with */
+	uint32_t	nused;
+	uint32_t	dropped;
+	uint64_t	start;				/* CLOCK_REALTIME ns when opened */
+};
+
+/*
+ * trace_open() creates the trace file and starts recording (a no-op when
+ * tracing is compiled out); trace_close() stops and syncs it.
+ */
+int trace_open(const char *path);
+void trace_close();
+void trace_event(int level, int ev, uint64_t a, uint64_t b, uint64_t c);
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ *	Tiny File System
+ *	File:	trace_decode.c
+ *
+ *	Prints the events in a trace file written by a TRACE_LEVEL>0 build of
+ *	tfs, oldest first, one per line:
+ *		seconds since start, thread id, event name, arguments
+ *
+ *	usage: trace_decode [-e event] tracefile
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+#define TRACE_NAME(id, name, fmt) name,
+#define TRACE_FMT(id, name, fmt) fmt,
+static const char *event_names[] = { TRACE_EVENTS(TRACE_NAME) };
+static const char *event_fmts[] = { TRACE_EVENTS(TRACE_FMT) };
+
+struct event {
+	uint32_t tid;
+	const struct trace_rec *rec;
+};
+
+static int cmp_event(const void *a, const void *b) {
+	uint64_t x = ((const struct event*)a)->rec->ts;
+	uint64_t y = ((const struct event*)b)->rec->ts;
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+	const char *only = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "e:")) != -1) {
+		if (opt != 'e') {
+			fprintf(stderr, "usage: %s [-e event] tracefile\n", argv[0]);
+			return 1;
+		}
+		only = optarg;
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "usage: %s [-e event] tracefile\n", argv[0]);
+		return 1;
+	}
+
+	int fd = open(argv[optind], O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	const struct trace_file_hdr *hdr = NULL;
+	if ((size_t)st.st_size >= sizeof(*hdr)) {
+		hdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	if (hdr == NULL || hdr == MAP_FAILED || hdr->magic != TRACE_MAGIC || hdr->ring_size != TRACE_RING_SIZE ||
+			sizeof(*hdr) + (size_t)hdr->nrings*sizeof(struct trace_ring) > (size_t)st.st_size) {
+		fprintf(stderr, "%s: not a trace file from this version\n", argv[optind]);
+		return 1;
+	}
+
+	// Step 1: Collect what is left in every ring that was used
+	const struct trace_ring *rings = (const struct trace_ring*)(hdr+1);
+	uint32_t i, nused = hdr->nused < hdr->nrings ? hdr->nused : hdr->nrings;
+	size_t n = 0;
+	struct event *events = malloc(sizeof(struct event)*((size_t)nused*TRACE_RING_SIZE+1));
+	for (i = 0; i < nused; i++) {
+		uint64_t head = rings[i].head, k;
+		uint64_t first = head > TRACE_RING_SIZE ? head-TRACE_RING_SIZE : 0;
+		for (k = first; k < head; k++) {
+			const struct trace_rec *rec = &rings[i].recs[k % TRACE_RING_SIZE];
+			if (rec->event >= TR_NEVENTS || (only != NULL && strcmp(event_names[rec->event], only) != 0)) {
+				continue;
+			}
+			events[n].tid = rec->tid;
+			events[n++].rec = rec;
+		}
+	}
+
+	// Step 2: Merge them by time and print
+	qsort(events, n, sizeof(struct event), cmp_event);
+	printf("# level %u, %u rings used (%u threads without one), %zu events\n",
+		hdr->level, hdr->nused, hdr->dropped, n);
+	size_t j;
+	for (j = 0; j < n; j++) {
+		const struct trace_rec *rec = events[j].rec;
+		printf("%12.6f %6u %-12s ", rec->ts/1e9, events[j].tid, event_names[rec->event]);
+		printf(event_fmts[rec->event], (unsigned long long)rec->args[0],
+			(unsigned long long)rec->args[1], (unsigned long long)rec->args[2]);
+		putchar('\n');
+	}
+	free(events);
+	return 0;
+}